@@ -76,8 +76,9 @@ bget(uint dev, uint blockno)
   }
 
   // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
+  // log.c keeps a reference (bpin) to each buffer it has
+  // logged until the block is checkpointed; B_DIRTY marks
+  // a buffer with a write in progress.
   for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
     if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
       b->dev = dev;
@@ -105,6 +106,38 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return in bv n locked bufs with the contents of blocks
+// blockno..blockno+n-1, reading each run of uncached blocks
+// from disk with one vectored request.
+void
+breadv(uint dev, uint blockno, int n, struct buf **bv)
+{
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    bv[i] = bget(dev, blockno+i);
+  for(i = 0; i < n; i = j+1){
+    for(j = i; j < n && (bv[j]->flags & B_VALID) == 0; j++)
+      ;
+    if(j > i)
+      iderwv(bv+i, j-i);
+  }
+}
+
+// Return a locked, zero-filled buf for a block whose old
+// contents do not matter, such as one just allocated,
+// without reading it from disk.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  memset(b->data, 0, BSIZE);
+  b->flags |= B_VALID;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,6 +148,39 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Write n locked bufs of consecutive blocks to disk
+// with one vectored request.
+void
+bwritev(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bv[i]->lock))
+      panic("bwritev");
+    bv[i]->flags |= B_DIRTY;
+  }
+  iderwv(bv, n);
+}
+
+// Hold a reference to b without locking it, keeping it
+// in the cache; the log pins the blocks it has logged.
+void
+bpin(struct buf *b)
+{
+  acquire(&bcache.lock);
+  b->refcnt++;
+  release(&bcache.lock);
+}
+
+void
+bunpin(struct buf *b)
+{
+  acquire(&bcache.lock);
+  b->refcnt--;
+  release(&bcache.lock);
+}
+
 // Release a locked buffer.
 // Move to the head of the MRU list.
 void
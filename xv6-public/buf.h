@@ -7,6 +7,8 @@ struct buf {
   struct buf *prev; // LRU cache list
   struct buf *next;
   struct buf *qnext; // disk queue
+  struct buf *vnext; // next buf of the same disk request
+  uint qtime;        // ticks when the request was queued
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
@@ -2,12 +2,30 @@
 #include "stat.h"
 #include "user.h"
 
+#define CHUNK (64*1024)
+
 char buf[512];
 
 void
 cat(int fd)
 {
-  int n;
+  int n, moved;
+
+  // Let the kernel move the data if it can: sendfile() from a
+  // file, or splice() if either side is a pipe. Each fails at
+  // once if it does not apply, and then read() and write() do.
+  moved = 0;
+  while((n = sendfile(1, fd, 0, CHUNK)) > 0)
+    moved = 1;
+  if(n < 0 && !moved)
+    while((n = splice(fd, 1, CHUNK)) > 0)
+      moved = 1;
+  if(n == 0)
+    return;
+  if(moved){
+    printf(1, "cat: write error\n");
+    exit();
+  }
 
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
@@ -1,7 +1,13 @@
 struct buf;
 struct context;
 struct file;
+struct iovec;
 struct inode;
+struct iostat;
+struct logstat;
+struct logtotal;
+struct page;
+struct pcidev;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -15,6 +21,11 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadv(uint, uint, int, struct buf**);
+void            bwritev(struct buf**, int);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+struct buf*     bnew(uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -33,19 +44,32 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filereadv(struct file*, struct iovec*, int, uint*);
+int             filewritev(struct file*, struct iovec*, int, uint*);
+int             fileseek(struct file*, int, int);
+int             filesend(struct file*, struct file*, uint*, int);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, char*, uint);
+int             isdirempty(struct inode*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            iflush(struct inode*);
+int             ifallocate(struct inode*, uint, uint);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            iorphan(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iupdate(struct inode*);
+void            iwriteback(uint, uint);
+struct page*    ipage(struct inode*, uint);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -57,6 +81,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            idestat(struct iostat*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -84,17 +110,55 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
-void            begin_op();
+int             log_writedatav(struct buf**, int);
+void            log_bfree(uint, uint);
+void            begin_op(int);
 void            end_op();
+void            log_force(void);
+uint            log_tid(void);
+void            log_wait(uint);
+void            log_tick(uint);
+int             logstat(struct logstat*, int, struct logtotal*);
+int             log_opmax(void);
+
+// mmap.c
+int             mmap(uint, uint, int, int, struct file*, uint);
+int             munmap(uint, uint);
+void            munmapall(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+int             mmapfault(uint, int);
+int             mmapcheck(uint, uint, int);
+int             mmapstr(uint, char**);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pcache.c
+void            pcacheinit(void);
+struct page*    pget(uint, uint, uint);
+void            pput(struct page*);
+void            pdirty(struct page*);
+void            pclean(struct page*);
+int             pdirtyv(uint, uint, struct page**, int);
+void            pdrop(uint, uint);
+void            pthrottle(void);
+void            pcache_tick(uint);
+void            psync(void);
+void            ppin(struct page*);
+void            punmap(uint, uint, uint, int);
+void            punpin(struct page*);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
 
+// pci.c
+uint            pciread(struct pcidev*, int);
+void            pciwrite(struct pcidev*, int, uint);
+int             pcifind(ushort, ushort, struct pcidev*);
+void            pcimaster(struct pcidev*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -108,6 +172,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+struct proc*    kproc(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -142,6 +207,8 @@ void            popcli(void);
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
 // string.c
@@ -156,7 +223,9 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argptrw(int, char**, int);
 int             argstr(int, char**);
+int             fetchbuf(uint, int, int);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
 void            syscall(void);
@@ -175,6 +244,12 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+extern int      virtioirq;
+void            virtioinit(void);
+void            virtiointr(void);
+int             virtiorwv(struct buf**, int);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
@@ -188,6 +263,8 @@ int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 
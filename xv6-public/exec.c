@@ -19,14 +19,14 @@ exec(char *path, char **argv)
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
-  begin_op();
+  begin_op(IPUTBLOCKS);
 
   if((ip = namei(path)) == 0){
     end_op();
     cprintf("exec: fail\n");
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);  // many processes may exec the same file
   pgdir = 0;
 
   // Check ELF header
@@ -56,7 +56,8 @@ exec(char *path, char **argv)
     if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  iunlockshared(ip);
+  iput(ip);
   end_op();
   ip = 0;
 
@@ -94,6 +95,7 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  munmapall(curproc);
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -107,7 +109,8 @@ exec(char *path, char **argv)
   if(pgdir)
     freevm(pgdir);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
     end_op();
   }
   return -1;
@@ -5,10 +5,17 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
+#include "mmu.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "page.h"
+#include "fcntl.h"
+#include "uio.h"
+
+#define WRITEPAGES 8  // pages filewrite() writes per chunk
 
 struct devsw devsw[NDEV];
 struct {
@@ -19,7 +26,11 @@ struct {
 void
 fileinit(void)
 {
+  struct file *f;
+
   initlock(&ftable.lock, "ftable");
+  for(f = ftable.file; f < ftable.file + NFILE; f++)
+    initsleeplock(&f->offlock, "file");
 }
 
 // Allocate a file structure.
@@ -73,7 +84,7 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
   else if(ff.type == FD_INODE){
-    begin_op();
+    begin_op(IPUTBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -84,74 +95,297 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     return 0;
   }
   return -1;
 }
 
-// Read from file f.
-int
-fileread(struct file *f, char *addr, int n)
+// Read from file f into the niov buffers of iov in turn, at
+// *off if f is an inode, advancing it. Stops at the first
+// buffer not filled. Returns the number of bytes read, or -1.
+static int
+readiov(struct file *f, struct iovec *iov, int niov, uint *off)
 {
-  int r;
+  int i, r, tot;
 
   if(f->readable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return piperead(f->pipe, addr, n);
+  if(f->type == FD_PIPE){
+    // A pipe returns what it has rather than wait for more,
+    // so it fills at most one buffer.
+    for(i = 0; i < niov && iov[i].iov_len == 0; i++)
+      ;
+    return i < niov ? piperead(f->pipe, iov[i].iov_base, iov[i].iov_len) : 0;
+  }
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
-    return r;
+    ilockshared(f->ip);
+    if(f->ip->type == T_DEV){
+      // consoleread() drops and retakes the lock exclusively.
+      iunlockshared(f->ip);
+      ilock(f->ip);
+    }
+    tot = 0;
+    for(i = 0; i < niov; i++){
+      if((r = readi(f->ip, iov[i].iov_base, *off, iov[i].iov_len)) < 0){
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+      *off += r;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
+    if(f->ip->type == T_DEV)
+      iunlock(f->ip);
+    else
+      iunlockshared(f->ip);
+    return tot;
   }
   panic("fileread");
 }
 
-//PAGEBREAK!
-// Write to file f.
+// Read from file f into the niov buffers of iov, at *off if
+// off is not 0 (pread) and at f's offset otherwise.
 int
-filewrite(struct file *f, char *addr, int n)
+filereadv(struct file *f, struct iovec *iov, int niov, uint *off)
 {
   int r;
 
+  if(off){
+    if(f->type != FD_INODE)
+      return -1;
+    return readiov(f, iov, niov, off);
+  }
+  if(f->type != FD_INODE)
+    return readiov(f, iov, niov, 0);
+  // Reads of the inode share its lock, so f->off needs its
+  // own: processes sharing f must not read the same bytes.
+  acquiresleep(&f->offlock);
+  r = readiov(f, iov, niov, &f->off);
+  releasesleep(&f->offlock);
+  return r;
+}
+
+// Read from file f.
+int
+fileread(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, 0);
+}
+
+//PAGEBREAK!
+// Write the niov buffers of iov to file f in turn, at *off if
+// f is an inode, advancing it. Returns the number of bytes
+// written, or -1.
+static int
+writeiov(struct file *f, struct iovec *iov, int niov, uint *off)
+{
+  int i, r, tot;
+
   if(f->writable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
+  if(f->type == FD_PIPE){
+    tot = 0;
+    for(i = 0; i < niov; i++){
+      if(pipewrite(f->pipe, iov[i].iov_base, iov[i].iov_len) < 0)
+        return -1;
+      tot += iov[i].iov_len;
+    }
+    return tot;
+  }
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
+    // a regular file's data only goes into the page cache
+    // (see writei), so needs no transaction. write it
+    // WRITEPAGES pages at a time, waiting first if there is
+    // too much for writeback (see pcache.c). an open inode's
+    // type never changes, so reading it unlocked is safe.
+    // a device, such as the console, logs nothing and needs
+    // no transaction either. anything else, a directory, is
+    // written a few blocks at a time, each chunk reserving
+    // what it may log: the i-node, an index block, 2 blocks
+    // of slop for non-aligned writes, and 2 per block. a
+    // chunk takes a quarter of the log at most, so that it
+    // joins the running transaction rather than forcing a
+    // commit to make room.
+    // a chunk runs on across buffers, so writev() of many
+    // small buffers is one transaction, not one per buffer.
+    int file = f->ip->type == T_FILE;
+    int dev = f->ip->type == T_DEV;
+    int nblocks = (log_opmax()/4 - 4) / 2;
+    int max, done = 0;  // bytes of iov[i] written
+    int m, left;
+
+    if(nblocks < 1)
+      nblocks = 1;
+    max = file || dev ? WRITEPAGES*PGSIZE : nblocks * BSIZE;
+
+    i = 0;
+    tot = 0;
+    r = 0;
+    while(i < niov){
+      if(file)
+        pthrottle();
+      else if(!dev)
+        begin_op(nblocks*2 + 4);
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      for(left = max; i < niov && left > 0; left -= m){
+        m = iov[i].iov_len - done;
+        if(m > left)
+          m = left;
+        if(m > 0 && (r = writei(f->ip, (char*)iov[i].iov_base + done, *off, m)) != m){
+          if(r >= 0)
+            panic("short filewrite");
+          break;
+        }
+        *off += m;
+        tot += m;
+        if((done += m) == iov[i].iov_len){
+          i++;
+          done = 0;
+        }
+      }
       iunlock(f->ip);
-      end_op();
+      if(!file && !dev)
+        end_op();
 
       if(r < 0)
         break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
     }
-    return i == n ? n : -1;
+    return i == niov ? tot : -1;
   }
   panic("filewrite");
 }
 
+// Write the niov buffers of iov to file f, at *off if off is
+// not 0 (pwrite) and at f's offset otherwise.
+int
+filewritev(struct file *f, struct iovec *iov, int niov, uint *off)
+{
+  if(off){
+    if(f->type != FD_INODE)
+      return -1;
+    return writeiov(f, iov, niov, off);
+  }
+  return writeiov(f, iov, niov, &f->off);
+}
+
+// Write to file f.
+int
+filewrite(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, 0);
+}
+
+// Set the offset of file f to off bytes from whence: the start
+// of the file, its offset now or its end. Offsets past the end
+// are allowed. Returns the new offset, or -1.
+int
+fileseek(struct file *f, int off, int whence)
+{
+  uint base;
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  acquiresleep(&f->offlock);
+  switch(whence){
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = f->off;
+    break;
+  case SEEK_END:
+    ilockshared(f->ip);
+    base = f->ip->size;
+    iunlockshared(f->ip);
+    break;
+  default:
+    releasesleep(&f->offlock);
+    return -1;
+  }
+  r = -1;
+  if((off >= 0 || -off <= base) && (int)(base + off) >= 0)
+    r = f->off = base + off;
+  releasesleep(&f->offlock);
+  return r;
+}
+
+// Send up to n bytes of regular file in, from *off, to out:
+// each page goes from the page cache straight to out.
+static int
+sendpages(struct file *out, struct file *in, uint *off, int n)
+{
+  struct inode *ip = in->ip;
+  struct page *pg;
+  uint o, size;
+  int m, r, tot;
+
+  o = *off;
+  for(tot = 0; tot < n; tot += m, o += m){
+    ilockshared(ip);
+    size = ip->size;
+    iunlockshared(ip);
+    if(o >= size)
+      break;
+    m = PGSIZE - o%PGSIZE;
+    if(m > n - tot)
+      m = n - tot;
+    if(m > size - o)
+      m = size - o;
+    if((pg = ipage(ip, o/PGSIZE)) == 0)
+      break;
+    r = filewrite(out, pg->data + o%PGSIZE, m);
+    punpin(pg);
+    if(r != m){
+      if(tot == 0)
+        tot = -1;
+      break;
+    }
+  }
+  *off = o;
+  return tot;
+}
+
+// Move up to n bytes from file in to file out inside the kernel,
+// for sendfile() and splice(). A regular file is read at *off,
+// or at in's offset if off is 0, through to its end. Anything
+// else is read once, as read() would, through a page of kernel
+// memory, so that a pipe returns as soon as it has moved some
+// data. Returns the number of bytes moved, or -1.
+int
+filesend(struct file *out, struct file *in, uint *off, int n)
+{
+  char *buf;
+  int r;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_INODE && in->ip->type == T_FILE){
+    if(off)
+      return sendpages(out, in, off, n);
+    // f->off is shared with readers (see fileread).
+    acquiresleep(&in->offlock);
+    r = sendpages(out, in, &in->off, n);
+    releasesleep(&in->offlock);
+    return r;
+  }
+  if(off || (buf = kalloc()) == 0)
+    return -1;
+  if((r = fileread(in, buf, n < PGSIZE ? n : PGSIZE)) > 0 && filewrite(out, buf, r) != r)
+    r = -1;
+  kfree(buf);
+  return r;
+}
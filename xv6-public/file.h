@@ -6,6 +6,7 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  struct sleeplock offlock; // serializes readers' use of off
 };
 
 
@@ -14,6 +15,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext;  // icache hash chain
+  struct inode *prev;   // icache LRU list, while ref is 0
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -22,7 +26,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+2]; //NDIRECT + INDIRECT(1) + DOUBLEINDIRECT(1)
+  uint flags;
+  uint dsize;         // size on disk; a file's may lag size (see iflush)
+  uint synctid;       // last transaction to change the disk inode
+  uint datatid;       // last to change its content, size or blocks
+  uint addrs[NDIRECT+2]; //NDIRECT + INDIRECT(1) + DOUBLEINDIRECT(1), or extent root
 };
 
 // table mapping major device number to
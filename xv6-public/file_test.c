@@ -2,6 +2,10 @@
 #include "stat.h"
 #include "user.h"
 #include "fcntl.h"
+#include "uio.h"
+
+struct logstat st[1];
+struct logtotal before, after;
 
 #define BSIZE 512
 #define NINDIRECT (BSIZE / sizeof(uint))
@@ -10,6 +14,12 @@
 
 #define NUM_TEST3 10
 
+#define HTLINEAR 2  // blocks before a directory is indexed
+#define NUM_HTREE 200
+
+#define NUM_SEND 10000  // bytes test 8 sends, across pages
+#define PIPESIZE 512
+
 char buf[NUM_BYTES], buf2[NUM_BYTES];
 char filename[16] = "test_file0";
 const int len = 10;
@@ -32,6 +42,8 @@ void test1(int first)
     failed("File open error\n");
   if (write(fd, buf, NUM_BYTES) < 0)
     failed("File write error\n");
+  if (fsync(fd) < 0)
+    failed("File fsync error\n");
   if (close(fd) < 0)
     failed("File close error\n");
   if (first)
@@ -67,13 +79,283 @@ void test2(int first)
     printf(1, "Test 2 passed\n\n");
 }
 
+void test4(void)
+{
+  struct iovec iov[3];
+  char small[16];
+  int fd;
+
+  printf(1, "Test 4: writev, lseek, pread, readv\n");
+  fd = open(filename, O_CREATE | O_RDWR);
+  if (fd < 0)
+    failed("File open error\n");
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "";
+  iov[1].iov_len = 0;
+  iov[2].iov_base = "defgh";
+  iov[2].iov_len = 5;
+  if (writev(fd, iov, 3) != 8)
+    failed("File writev error\n");
+  if (lseek(fd, -3, SEEK_END) != 5 || read(fd, small, 3) != 3 || small[0] != 'f')
+    failed("File lseek error\n");
+  if (pread(fd, small, 2, 1) != 2 || small[0] != 'b' || small[1] != 'c')
+    failed("File pread error\n");
+  if (pwrite(fd, "X", 1, 7) != 1 || lseek(fd, 0, SEEK_CUR) != 8)
+    failed("File pwrite error\n");
+  lseek(fd, 0, SEEK_SET);
+  iov[0].iov_base = small;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = small + 4;
+  iov[1].iov_len = 8;
+  if (readv(fd, iov, 2) != 8 || small[3] != 'd' || small[7] != 'X')
+    failed("File readv error\n");
+  close(fd);
+  if (unlink(filename) < 0)
+    failed("File unlink error\n");
+  printf(1, "Test 4 passed\n\n");
+}
+
+void test5(void)
+{
+  struct stat st;
+  char small[16];
+  int fd, i;
+
+  printf(1, "Test 5: sparse file\n");
+  fd = open(filename, O_CREATE | O_RDWR);
+  if (fd < 0)
+    failed("File open error\n");
+  if (lseek(fd, NUM_BYTES, SEEK_SET) != NUM_BYTES || write(fd, "end", 3) != 3)
+    failed("File write past end error\n");
+  if (fsync(fd) < 0 || fstat(fd, &st) < 0)
+    failed("File fsync error\n");
+  if (st.size != NUM_BYTES + 3 || st.blocks > 2)
+    failed("Hole has blocks\n");
+  if (pread(fd, small, sizeof(small), NUM_BYTES / 2) != sizeof(small))
+    failed("File pread error\n");
+  for (i = 0; i < sizeof(small); i++)
+    if (small[i] != 0)
+      failed("Hole not zeroes\n");
+  close(fd);
+  if (unlink(filename) < 0)
+    failed("File unlink error\n");
+  printf(1, "Test 5 passed\n\n");
+}
+
+void test6(void)
+{
+  struct stat st;
+  uint blocks;
+  int fd, i;
+
+  printf(1, "Test 6: fallocate\n");
+  fd = open(filename, O_CREATE | O_RDWR);
+  if (fd < 0)
+    failed("File open error\n");
+  if (fallocate(fd, 0, NUM_BYTES) < 0 || fstat(fd, &st) < 0)
+    failed("File fallocate error\n");
+  if (st.size != NUM_BYTES || st.blocks < NUM_BYTES / BSIZE)
+    failed("Blocks not allocated\n");
+  blocks = st.blocks;
+  if (read(fd, buf, NUM_BYTES) != NUM_BYTES)
+    failed("File read error\n");
+  for (i = 0; i < NUM_BYTES; i++)
+    if (buf[i] != 0)
+      failed("Allocated blocks not zeroes\n");
+  for (i = 0; i < NUM_BYTES; i++)
+    buf[i] = (i % 26) + 'a';
+  if (pwrite(fd, buf, NUM_BYTES, 0) != NUM_BYTES || fdatasync(fd) < 0 || fstat(fd, &st) < 0)
+    failed("File write error\n");
+  if (st.size != NUM_BYTES || st.blocks != blocks)
+    failed("Write allocated more blocks\n");
+  if (fallocate(fd, 0, 0x7fffffff) >= 0 || fstat(fd, &st) < 0)
+    failed("Too large fallocate succeeded\n");
+  if (st.size != NUM_BYTES || st.blocks != blocks)
+    failed("Too large fallocate changed file\n");
+  close(fd);
+  if (unlink(filename) < 0)
+    failed("File unlink error\n");
+  printf(1, "Test 6 passed\n\n");
+}
+
+// Names with one FNV-1a hash, more than a leaf of an
+// indexed directory holds.
+char *samehash[] = {
+  "collide", "habd6oad9", "hafzf2muo", "haf2om22e", "haf79n654",
+  "haiscgsdp", "hajhtjsm5", "hak2ed0mf", "hamwzsjke", "hapc24edo",
+  "happ52t0v", "hap65wshd", "harn6fek9", "hauevsiz3", "hawdxbr9i",
+  "ha025qp2g", "ha4jqm2hw", "ha4pbuwon",
+};
+#define DPB (BSIZE / 32)  // dirents per block
+
+// Name the i'th entry of test 7's directory, longer than
+// the old 14-byte DIRSIZ.
+char *htname(int i)
+{
+  static char name[40] = "htdir/htree_directory_name_000";
+  int n = strlen(name);
+
+  name[n - 3] = '0' + i / 100;
+  name[n - 2] = '0' + i / 10 % 10;
+  name[n - 1] = '0' + i % 10;
+  return name;
+}
+
+void test7(void)
+{
+  struct stat st;
+  int fd, i, nlink;
+
+  printf(1, "Test 7: indexed directory\n");
+  if (mkdir("htdir") < 0)
+    failed("Directory mkdir error\n");
+  for (i = 0; i < NUM_HTREE; i++) {
+    if ((fd = open(htname(i), O_CREATE | O_RDWR)) < 0)
+      failed("Directory create error\n");
+    close(fd);
+  }
+  if (stat("htdir", &st) < 0)
+    failed("Directory stat error\n");
+  if (st.size <= HTLINEAR * BSIZE)
+    failed("Directory too small to be indexed\n");
+  for (i = 0; i < NUM_HTREE; i++)
+    if ((fd = open(htname(i), O_RDONLY)) < 0)
+      failed("Directory lookup error\n");
+    else
+      close(fd);
+  for (i = 1; i < NUM_HTREE; i += 2)
+    if (unlink(htname(i)) < 0)
+      failed("Directory unlink error\n");
+  for (i = 0; i < NUM_HTREE; i++) {
+    fd = open(htname(i), O_RDONLY);
+    if ((fd >= 0) != (i % 2 == 0))
+      failed("Directory lookup after unlink error\n");
+    if (fd >= 0)
+      close(fd);
+  }
+  for (i = 1; i < NUM_HTREE; i += 2) {
+    if ((fd = open(htname(i), O_CREATE | O_RDWR)) < 0)
+      failed("Directory re-create error\n");
+    close(fd);
+  }
+  for (i = 0; i < NUM_HTREE; i++)
+    if ((fd = open(htname(i), O_RDONLY)) < 0)
+      failed("Directory lookup after re-create error\n");
+    else
+      close(fd);
+  if (unlink("htdir") >= 0)
+    failed("Non-empty directory removed\n");
+
+  // A leaf full of names with one hash can't split, so
+  // adding another must fail, and leave the directory as
+  // it was.
+  if (chdir("htdir") < 0 || stat(".", &st) < 0)
+    failed("Directory chdir error\n");
+  nlink = st.nlink;
+  for (i = 0; i < DPB; i++) {
+    if ((fd = open(samehash[i], O_CREATE | O_RDWR)) < 0)
+      failed("Directory create error\n");
+    close(fd);
+  }
+  if (open(samehash[DPB], O_CREATE | O_RDWR) >= 0)
+    failed("Create in a full leaf succeeded\n");
+  if (mkdir(samehash[DPB + 1]) >= 0 || mknod(samehash[DPB + 1], 1, 1) >= 0)
+    failed("Mkdir in a full leaf succeeded\n");
+  if (open(samehash[DPB], O_RDONLY) >= 0 || stat(".", &st) < 0 || st.nlink != nlink)
+    failed("Failed create changed the directory\n");
+  for (i = 0; i < DPB; i++)
+    if (unlink(samehash[i]) < 0)
+      failed("Directory unlink error\n");
+  if (chdir("..") < 0)
+    failed("Directory chdir error\n");
+
+  for (i = 0; i < NUM_HTREE; i++)
+    if (unlink(htname(i)) < 0)
+      failed("Directory unlink error\n");
+  if (unlink("htdir") < 0)
+    failed("Empty directory not removed\n");
+  printf(1, "Test 7 passed\n\n");
+}
+
+void test8(void)
+{
+  struct stat st;
+  int in, out, p[2], i;
+  uint off;
+
+  printf(1, "Test 8: sendfile and splice\n");
+  out = open("send_in", O_CREATE | O_RDWR);
+  if (out < 0 || write(out, buf, NUM_SEND) != NUM_SEND)
+    failed("File write error\n");
+  close(out);
+  if ((in = open("send_in", O_RDONLY)) < 0 || (out = open("send_out", O_CREATE | O_RDWR)) < 0)
+    failed("File open error\n");
+
+  // At an explicit offset, which advances, leaving in's alone.
+  off = 100;
+  if (sendfile(out, in, &off, NUM_SEND) != NUM_SEND - 100 || off != NUM_SEND)
+    failed("sendfile error\n");
+  if (lseek(in, 0, SEEK_CUR) != 0)
+    failed("sendfile moved the input offset\n");
+  if (pread(out, buf2, NUM_SEND - 100, 0) != NUM_SEND - 100)
+    failed("File read error\n");
+  for (i = 0; i < NUM_SEND - 100; i++)
+    if (buf2[i] != buf[i + 100])
+      failed("sendfile copied wrong data\n");
+
+  // From a file to itself: append a copy.
+  off = 0;
+  if (sendfile(out, out, &off, NUM_SEND - 100) != NUM_SEND - 100 || fstat(out, &st) < 0)
+    failed("sendfile to itself error\n");
+  if (st.size != 2 * (NUM_SEND - 100))
+    failed("sendfile to itself wrong size\n");
+  if (pread(out, buf2, NUM_SEND - 100, NUM_SEND - 100) != NUM_SEND - 100)
+    failed("File read error\n");
+  for (i = 0; i < NUM_SEND - 100; i++)
+    if (buf2[i] != buf[i + 100])
+      failed("sendfile to itself copied wrong data\n");
+  close(out);
+
+  // Through a pipe, at in's offset.
+  if (pipe(p) < 0 || (out = open("send_pipe", O_CREATE | O_RDWR)) < 0)
+    failed("Pipe open error\n");
+  if (splice(in, p[1], PIPESIZE) != PIPESIZE || lseek(in, 0, SEEK_CUR) != PIPESIZE)
+    failed("splice to pipe error\n");
+  if (splice(p[0], out, PIPESIZE) != PIPESIZE)
+    failed("splice from pipe error\n");
+  if (pread(out, buf2, PIPESIZE, 0) != PIPESIZE)
+    failed("File read error\n");
+  for (i = 0; i < PIPESIZE; i++)
+    if (buf2[i] != buf[i])
+      failed("splice copied wrong data\n");
+
+  if (splice(in, out, 1) >= 0)
+    failed("splice without a pipe succeeded\n");
+  if (sendfile(out, p[0], 0, 1) >= 0)
+    failed("sendfile from a pipe succeeded\n");
+  close(p[0]);
+  close(p[1]);
+  close(out);
+  close(in);
+  if (unlink("send_in") < 0 || unlink("send_out") < 0 || unlink("send_pipe") < 0)
+    failed("File unlink error\n");
+  printf(1, "Test 8 passed\n\n");
+}
+
 int main(int argc, char *argv[])
 {
-  int i;
+  int i, t0, t1;
   for (i = 0; i < NUM_BYTES; i++)
     buf[i] = (i % 26) + 'a';
 
+  logstat(st, 0, &before);
+  t0 = uptime();
   test1(1);
+  t1 = uptime();
+  logstat(st, 0, &after);
+  printf(1, "Test 1 took %d ticks, %d log commits of %d blocks\n\n",
+         t1 - t0, after.commits - before.commits, after.blocks - before.blocks);
   test2(1);
 
   printf(1, "Test 3: repeating test 1 & 2\n");
@@ -87,8 +369,16 @@ int main(int argc, char *argv[])
     test2(0);
     printf(1, "ok\n");
   }
-  printf(1, "Test 3 passed\n");
-  
+  printf(1, "Test 3 passed\n\n");
+
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  if (sync() < 0)
+    failed("sync error\n");
+
   printf(1, "All tests passed!!\n");
   exit();
 }
@@ -19,10 +19,15 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "page.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-static void itrunc(struct inode*);
+static int itrunc(struct inode*, int);
+static void idelete(struct inode*);
+static void truncd(void);
+static void dinit(void);
+static void dcachepurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -51,32 +56,179 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The disk is divided into block groups of BPB blocks, one
+// per bitmap block, in the manner of ext2. Each group keeps
+// an in-memory count of its free blocks and a cursor where
+// the next search starts, guarded by one of NBGLOCK
+// spin-locks (group g uses lock g % NBGLOCK), so allocations
+// in different groups mostly proceed in parallel; the
+// bitmap block's buffer lock serializes the searches within
+// a group. Callers pass a goal block, and
+// balloc() starts in the goal's group so a file's blocks
+// stay close to each other and to its inode.
+// The counts are rebuilt from the bitmaps at boot.
+
+#define NBGLOCK 16
+
+struct bgroup {
+  uint nfree;     // free blocks in the group
+  uint cursor;    // bit to start the next search at
+};
+
+struct {
+  uint ngroups;
+  struct spinlock lock[NBGLOCK];
+  struct bgroup group[NBGROUP];
+} bgroups;
+
+#define BGLOCK(g) (&bgroups.lock[(g) % NBGLOCK])
 
-// Allocate a zeroed disk block.
+// Number of blocks in group g; the last group may be short.
 static uint
-balloc(uint dev)
+bgsize(uint g)
+{
+  return min(BPB, sb.size - g*BPB);
+}
+
+static void
+bginit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint g, bi;
+
+  bgroups.ngroups = (sb.size + BPB - 1) / BPB;
+  if(bgroups.ngroups > NBGROUP)
+    panic("bginit: too many groups");
+  for(g = 0; g < NBGLOCK; g++)
+    initlock(&bgroups.lock[g], "bgroup");
+  for(g = 0; g < bgroups.ngroups; g++){
+    bp = bread(dev, BBLOCK(g*BPB, sb));
+    for(bi = 0; bi < bgsize(g); bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bgroups.group[g].nfree++;
+    brelse(bp);
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+// Allocate a run of up to want blocks in group g, starting
+// the search at bit start: the first free block found and as
+// many free blocks as directly follow it. Sets *got to the
+// run's length. Returns 0 if the group is full.
+static uint
+bgalloc(uint dev, uint g, uint start, uint want, uint *got)
+{
+  struct bgroup *gp;
+  struct buf *bp;
+  uint n, k, bi, extra;
+
+  gp = &bgroups.group[g];
+  acquire(BGLOCK(g));
+  if(gp->nfree == 0){
+    release(BGLOCK(g));
+    return 0;
+  }
+  gp->nfree--;  // claim a block; the bitmap must have one free
+  if(start == 0)
+    start = gp->cursor;
+  release(BGLOCK(g));
+
+  n = bgsize(g);
+  bp = bread(dev, BBLOCK(g*BPB, sb));
+  for(k = 0; k < n; k++){
+    bi = (start + k) % n;
+    if(bi % 8 == 0 && bi + 8 <= n && bp->data[bi/8] == 0xff){
+      k += 7;  // skip a full byte
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0){  // Is block free?
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      acquire(BGLOCK(g));
+      extra = min(want - 1, gp->nfree);
+      gp->nfree -= extra;  // claim blocks to extend the run
+      release(BGLOCK(g));
+      for(k = 1; k <= extra && bi + k < n; k++){
+        if(bp->data[(bi+k)/8] & (1 << ((bi+k) % 8)))
+          break;
+        bp->data[(bi+k)/8] |= 1 << ((bi+k) % 8);
       }
+      *got = k;
+      log_write(bp);
+      brelse(bp);
+      acquire(BGLOCK(g));
+      gp->nfree += extra - (k - 1);  // claims the run did not use
+      gp->cursor = (bi + k) % n;
+      release(BGLOCK(g));
+      return g*BPB + bi;
     }
-    brelse(bp);
+  }
+  panic("bgalloc: free count");
+}
+
+// Allocate a run of up to n contiguous disk blocks, as close
+// to goal as possible, and set *got to its length. Their
+// contents are left as they were.
+static uint
+bclaimrun(uint dev, uint goal, uint n, uint *got)
+{
+  uint g0, g, i, b;
+
+  if(goal >= sb.size)
+    goal = 0;
+  g0 = goal / BPB;
+  for(i = 0; i < bgroups.ngroups; i++){
+    g = (g0 + i) % bgroups.ngroups;
+    if((b = bgalloc(dev, g, i == 0 ? goal % BPB : 0, n, got)) != 0)
+      return b;
   }
   panic("balloc: out of blocks");
 }
 
+// Number of free blocks, from the groups' counts.
+static uint
+bavail(void)
+{
+  uint g, n;
+
+  n = 0;
+  for(g = 0; g < bgroups.ngroups; g++){
+    acquire(BGLOCK(g));
+    n += bgroups.group[g].nfree;
+    release(BGLOCK(g));
+  }
+  return n;
+}
+
+// Allocate a disk block, as close to goal as possible.
+// Its contents are left as they were.
+static uint
+bclaim(uint dev, uint goal)
+{
+  uint got;
+
+  return bclaimrun(dev, goal, 1, &got);
+}
+
+// Allocate a zeroed disk block, as close to goal as possible.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+
+  b = bclaim(dev, goal);
+  bzero(dev, b);
+  return b;
+}
+
+// Return n freed blocks to the count of group g.
+static void
+bgfree(uint g, uint n)
+{
+  acquire(BGLOCK(g));
+  bgroups.group[g].nfree += n;
+  release(BGLOCK(g));
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -92,6 +244,38 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  bgfree(b / BPB, 1);
+  log_bfree(b, 1);
+}
+
+// Free n contiguous disk blocks starting at b.
+// Touches each bitmap block only once.
+static void
+bfreerun(int dev, uint b, uint n)
+{
+  struct buf *bp;
+  int bi, m;
+  uint g, cnt;
+
+  while(n > 0){
+    g = b / BPB;
+    bp = bread(dev, BBLOCK(b, sb));
+    cnt = 0;
+    do {
+      bi = b % BPB;
+      m = 1 << (bi % 8);
+      if((bp->data[bi/8] & m) == 0)
+        panic("freeing free block");
+      bp->data[bi/8] &= ~m;
+      b++;
+      n--;
+      cnt++;
+    } while(n > 0 && b % BPB != 0);
+    log_write(bp);
+    brelse(bp);
+    bgfree(g, cnt);
+    log_bfree(b - cnt, cnt);
+  }
 }
 
 // Inodes.
@@ -116,8 +300,9 @@ bfree(int dev, uint b)
 // rest of the file system code.
 //
 // * Allocation: an inode is allocated if its type (on disk)
-//   is non-zero. ialloc() allocates, and iput() frees if
-//   the reference and link counts have fallen to zero.
+//   is non-zero, and its bit in the inode map is then set.
+//   ialloc() allocates, and iput() frees if the reference
+//   and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
 //   is free if ip->ref is zero. Otherwise ip->ref tracks
@@ -162,27 +347,146 @@ bfree(int dev, uint b)
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// Entries are found through a hash on (dev, inum). An entry
+// whose ref falls to 0 stays hashed, and valid, on an LRU list,
+// so iget() of a recently used inode needs no disk read in
+// ilock(). iget() recycles the least recently used such entry
+// once there are NINODE entries, and otherwise takes a page of
+// new entries from kalloc(); so it runs out only if memory does.
+
+#define NIHASH 127
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct inode lru;  // lru.next is most recently used
+  int n;             // entries allocated
+  struct inode *trunc;  // inodes for truncd to free, linked by next
 } icache;
 
+#define IHASH(dev, inum) (((dev)*31 + (inum)) % NIHASH)
+
+// Take ip off the LRU list.
+static void
+ilruremove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// Put ip at the front of the LRU list, or at the back if it
+// caches nothing.
+static void
+ilruinsert(struct inode *ip, int front)
+{
+  if(front){
+    ip->next = icache.lru.next;
+    ip->prev = &icache.lru;
+  } else {
+    ip->next = &icache.lru;
+    ip->prev = icache.lru.prev;
+  }
+  ip->next->prev = ip;
+  ip->prev->next = ip;
+}
+
+// Add a page of unused entries to the cache,
+// if there is memory.
+static void
+igrow(void)
+{
+  struct inode *ip, *end;
+
+  if((ip = (struct inode*)kalloc()) == 0)
+    return;
+  memset(ip, 0, PGSIZE);
+  end = ip + PGSIZE/sizeof(*ip);
+  for(; ip < end; ip++){
+    initsleeplock(&ip->lock, "inode");
+    ilruinsert(ip, 0);
+    icache.n++;
+  }
+}
+
+// The least recently used entry that iget() may recycle, or
+// 0. Not one whose size is only in memory (see iflush).
+static struct inode*
+ivictim(void)
+{
+  struct inode *ip;
+
+  for(ip = icache.lru.prev; ip != &icache.lru; ip = ip->prev){
+    if(!ip->valid || ip->size == ip->dsize)
+      return ip;
+  }
+  return 0;
+}
+
+// Take ip off its hash chain, if it is on one.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      return;
+    }
+  }
+}
+
+// The inode map holds a bit per inode, set in the same
+// transaction that gives the inode a type. ialloc() claims
+// a free inode from the count and searches the map from a
+// cursor, so creating a file reads one map block (normally
+// cached) and the new inode's block, however many inodes
+// are in use.
+struct {
+  struct spinlock lock;
+  uint nfree;     // free inodes
+  uint cursor;    // inode number to start the next search at
+} imap;
+
+static void
+iminit(int dev)
+{
+  struct buf *bp;
+  uint inum;
+
+  initlock(&imap.lock, "imap");
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || bp->blockno != IMBLOCK(inum, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IMBLOCK(inum, sb));
+    }
+    if((bp->data[(inum%BPB)/8] & (1 << (inum%8))) == 0)
+      imap.nfree++;
+  }
+  if(bp)
+    brelse(bp);
+  imap.cursor = 1;
+}
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.lru.next = &icache.lru;
+  icache.lru.prev = &icache.lru;
 
+  dinit();
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
           sb.bmapstart);
+  bginit(dev);
+  iminit(dev);
+  kproc("truncd", truncd);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -194,23 +498,77 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum, start, k, bi;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  acquire(&imap.lock);
+  if(imap.nfree == 0)
+    panic("ialloc: no inodes");
+  imap.nfree--;  // claim an inode; the map must have a free bit
+  start = imap.cursor;
+  release(&imap.lock);
+
+  bp = 0;
+  for(k = 0; k < sb.ninodes; k++){
+    inum = (start + k) % sb.ninodes;
+    if(inum == 0)
+      continue;
+    if(bp == 0 || bp->blockno != IMBLOCK(inum, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IMBLOCK(inum, sb));
     }
-    brelse(bp);
+    bi = inum % BPB;
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff && inum + 8 <= sb.ninodes){
+      k += 7;  // skip a full byte
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      goto found;
   }
-  panic("ialloc: no inodes");
+  panic("ialloc: inode map");
+
+found:
+  bp->data[bi/8] |= 1 << (bi % 8);
+  log_write(bp);
+  brelse(bp);
+  acquire(&imap.lock);
+  imap.cursor = inum + 1;
+  release(&imap.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  // Regular files map their content with extents; directories
+  // are small and grow a dirent at a time, so keep addrs[].
+  if(type == T_FILE)
+    dip->flags = I_EXTENT;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// Clear inode inum's bit in the inode map.
+static void
+ifree(uint dev, uint inum)
+{
+  struct buf *bp;
+  uint bi;
+
+  bp = bread(dev, IMBLOCK(inum, sb));
+  bi = inum % BPB;
+  if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+    panic("freeing free inode");
+  bp->data[bi/8] &= ~(1 << (bi % 8));
+  log_write(bp);
+  brelse(bp);
+  acquire(&imap.lock);
+  imap.nfree++;
+  release(&imap.lock);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -229,10 +587,14 @@ iupdate(struct inode *ip)
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
+  if(ip->type != T_FILE)
+    ip->dsize = ip->size;  // only file data is cached in pages
+  dip->size = ip->dsize;
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->synctid = log_tid();
 }
 
 // Find the inode with number inum on device dev
@@ -241,31 +603,34 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ilruremove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Recycle the least recently used entry, or add more.
+  if(icache.n < NINODE || ivictim() == 0)
+    igrow();
+  if((ip = ivictim()) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  ilruremove(ip);
+  iunhash(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
   release(&icache.lock);
 
   return ip;
@@ -282,31 +647,44 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Read locked inode ip from disk. It becomes valid unless
+// the inode is free.
+static void
+iload(struct inode *ip)
+{
+  struct buf *bp;
+  struct dinode *dip;
+
+  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  ip->type = dip->type;
+  ip->major = dip->major;
+  ip->minor = dip->minor;
+  ip->nlink = dip->nlink;
+  ip->size = dip->size;
+  ip->dsize = dip->size;
+  ip->flags = dip->flags;
+  memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+  brelse(bp);
+  ip->valid = ip->type != 0;
+  // Changes made before the inode was last cached may not
+  // have committed yet.
+  ip->synctid = ip->datatid = log_tid();
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
 ilock(struct inode *ip)
 {
-  struct buf *bp;
-  struct dinode *dip;
-
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
-    ip->major = dip->major;
-    ip->minor = dip->minor;
-    ip->nlink = dip->nlink;
-    ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
-    brelse(bp);
-    ip->valid = 1;
-    if(ip->type == 0)
+    iload(ip);
+    if(ip->valid == 0)
       panic("ilock: no type");
   }
 }
@@ -321,13 +699,94 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared, for reading only: several
+// readers can hold it at once, and none while ilock() holds
+// it. Loading the inode from disk needs the exclusive lock,
+// so the first reader takes that, then retries shared.
+// Nothing clears ip->valid while we hold a reference, so
+// the second pass succeeds.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquiresleepshared(&ip->lock);
+    if(ip->valid)
+      return;
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
+// The orphan list: one block of inode numbers, 0 for a free
+// slot, of inodes that have no links but still have blocks.
+
+// Add inode ip to the orphan list, unless it is there. If
+// the list is full, ip's blocks leak if the system crashes
+// before they are freed.
+static void
+orphanadd(struct inode *ip)
+{
+  struct buf *bp;
+  uint *a;
+  int i, f;
+
+  bp = bread(ip->dev, sb.orphanblock);
+  a = (uint*)bp->data;
+  f = -1;
+  for(i = 0; i < NORPHAN; i++){
+    if(a[i] == ip->inum)
+      break;
+    if(a[i] == 0 && f < 0)
+      f = i;
+  }
+  if(i == NORPHAN && f >= 0){
+    a[f] = ip->inum;
+    log_write(bp);
+  }
+  brelse(bp);
+}
+
+// Take inode inum off the orphan list, if it is there.
+static void
+orphandel(uint dev, uint inum)
+{
+  struct buf *bp;
+  uint *a;
+  int i;
+
+  bp = bread(dev, sb.orphanblock);
+  a = (uint*)bp->data;
+  for(i = 0; i < NORPHAN; i++){
+    if(a[i] == inum){
+      a[i] = 0;
+      log_write(bp);
+      break;
+    }
+  }
+  brelse(bp);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode cache entry can
 // be recycled.
 // If that was the last reference and the inode has no links
-// to it, free the inode (and its content) on disk.
-// All calls to iput() must be inside a transaction in
-// case it has to free the inode.
+// to it, free the inode (and its content) on disk; a file
+// with more blocks than IPUTBLOCKS allows is finished by
+// truncd. All calls to iput() must be inside a transaction,
+// of IPUTBLOCKS, in case it has to free the inode.
 void
 iput(struct inode *ip)
 {
@@ -337,18 +796,141 @@ iput(struct inode *ip)
     int r = ip->ref;
     release(&icache.lock);
     if(r == 1){
-      // inode has no links and no other references: truncate and free.
-      itrunc(ip);
-      ip->type = 0;
-      iupdate(ip);
-      ip->valid = 0;
+      // inode has no links and no other references: free its
+      // blocks, or as many as the caller's transaction has
+      // room for, and leave the rest to truncd.
+      if(itrunc(ip, IPUTBLOCKS - 2))
+        idelete(ip);
+      else {
+        orphanadd(ip);
+        acquire(&icache.lock);
+        ip->ref++;  // truncd's
+        ip->next = icache.trunc;
+        icache.trunc = ip;
+        wakeup(&icache.trunc);
+        release(&icache.lock);
+      }
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0)
+    ilruinsert(ip, ip->valid);
+  release(&icache.lock);
+}
+
+// Free locked inode ip, which has no links and no blocks.
+static void
+idelete(struct inode *ip)
+{
+  if(ip->type == T_DIR)
+    dcachepurge(ip->dev, ip->inum);
+  ip->type = 0;
+  iupdate(ip);
+  ifree(ip->dev, ip->inum);
+  orphandel(ip->dev, ip->inum);
+  ip->valid = 0;
+}
+
+// Caller has just dropped locked inode ip's last link. If
+// another reference keeps it in use, put it on the orphan
+// list, so that a crash before iput() frees it doesn't leak
+// its blocks.
+void
+iorphan(struct inode *ip)
+{
+  int r;
+
+  acquire(&icache.lock);
+  r = ip->ref;
   release(&icache.lock);
+  if(r > 1)
+    orphanadd(ip);
+}
+
+// Free the blocks of inode ip, which has no links, and then
+// the inode, in as many transactions as that takes. The
+// caller hands over its reference.
+static void
+iorphanfree(struct inode *ip)
+{
+  int n, done;
+
+  n = min(TRUNCBLOCKS, log_opmax());
+  do {
+    begin_op(n);
+    acquiresleep(&ip->lock);
+    if(ip->valid == 0)
+      iload(ip);
+    done = 1;
+    if(ip->valid && ip->nlink == 0){
+      if((done = itrunc(ip, n - 2)) != 0)
+        idelete(ip);
+    } else
+      orphandel(ip->dev, ip->inum);
+    releasesleep(&ip->lock);
+    if(done)
+      iput(ip);
+    end_op();
+  } while(!done);
+}
+
+// Queue the inodes a crash left on the orphan list of dev
+// for truncd. Any that a process already uses is an orphan
+// of this boot, which its last iput() takes care of.
+static void
+orphanscan(uint dev)
+{
+  uint inum[NORPHAN];
+  struct buf *bp;
+  struct inode *ip;
+  int i, mine;
+
+  bp = bread(dev, sb.orphanblock);
+  memmove(inum, bp->data, sizeof(inum));
+  brelse(bp);
+  for(i = 0; i < NORPHAN; i++){
+    if(inum[i] == 0)
+      continue;
+    ip = iget(dev, inum[i]);
+    acquire(&icache.lock);
+    if((mine = ip->ref == 1) != 0){
+      ip->next = icache.trunc;
+      icache.trunc = ip;
+    }
+    release(&icache.lock);
+    if(!mine){
+      begin_op(IPUTBLOCKS);
+      iput(ip);
+      end_op();
+    }
+  }
+}
+
+// The truncation thread. Frees the blocks of unlinked files
+// that iput() had no room for, in bounded transactions, so
+// that removing a large file neither stalls the process nor
+// overflows the log. The inodes stay on the orphan list until
+// they are free, and truncd starts by finishing any a crash
+// interrupted.
+static void
+truncd(void)
+{
+  struct inode *ip;
+
+  orphanscan(ROOTDEV);
+  acquire(&icache.lock);
+  for(;;){
+    if((ip = icache.trunc) == 0){
+      sleep(&icache.trunc, &icache.lock);
+      continue;
+    }
+    icache.trunc = ip->next;
+    release(&icache.lock);
+    iorphanfree(ip);
+    acquire(&icache.lock);
+  }
 }
 
 // Common idiom: unlock, then put.
@@ -366,20 +948,68 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+// Extent-mapped inodes (I_EXTENT) use the extent tree
+// below instead.
+
+static uint extbmap(struct inode*, uint, int*);
+static uint extlookup(struct inode*, uint, uint*, int*);
+static void extinsert(struct inode*, struct extent*);
+static uint extwritten(struct inode*, uint, uint, uint*);
+struct tbudget;
+static int exttrunc(struct inode*, struct exthdr*, struct tbudget*);
+
+// Allocation goal for a block of ip with nothing before it:
+// the block group its inode belongs to. Inodes are divided
+// among the groups in order, as ext2 keeps an inode table
+// per group.
+static uint
+igoal(struct inode *ip)
+{
+  uint ipg;
+
+  ipg = (sb.ninodes + bgroups.ngroups - 1) / bgroups.ngroups;
+  return (ip->inum / ipg) * BPB;
+}
+
+// Allocation goal for an entry of an address array whose
+// previous entry is prev: the block right after it.
+static uint
+nextgoal(uint prev, uint dflt)
+{
+  return prev ? prev + 1 : dflt;
+}
+
+// Allocate a block to hold data of ip. If the caller is
+// about to write it (fresh != 0), skip zeroing it through
+// the log and set *fresh: the writer fills the whole block
+// itself (see writei).
+static uint
+bdata(struct inode *ip, uint goal, int *fresh)
+{
+  if(fresh == 0)
+    return balloc(ip->dev, goal);
+  *fresh = 1;
+  return bclaim(ip->dev, goal);
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; see bdata()
+// for fresh.
 // inode's bn'th block
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int *fresh)
 {
   uint addr, *a, *d; // d: double indirect
   struct buf *bp, *dbp; // dbp: double block pointer
 
+  if(ip->flags & I_EXTENT)
+    return extbmap(ip, bn, fresh);
+
   // direct search
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bdata(ip,
+        nextgoal(bn ? ip->addrs[bn-1] : 0, igoal(ip)), fresh);
     return addr;
   }
 
@@ -389,11 +1019,13 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev,
+        nextgoal(ip->addrs[NDIRECT-1], igoal(ip)));
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = bdata(ip,
+        nextgoal(bn ? a[bn-1] : 0, ip->addrs[NDIRECT] + 1), fresh);
       log_write(bp);
     }
     brelse(bp);
@@ -405,14 +1037,14 @@ bmap(struct inode *ip, uint bn)
   if(bn < NDOUBLEINDIRECT) {
 	// Load double indirect block, allocating if necessary.
 	if((addr = ip->addrs[NDIRECT+1]) == 0)
-		ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+		ip->addrs[NDIRECT+1] = addr = balloc(ip->dev, igoal(ip));
 
 	bp = bread(ip->dev, addr); // level-1 block pointer
 	a = (uint*)bp->data; // level-1 block entries
 	
 	// bn/INDIRECT: 몫: head  나머지: data
 	if((addr = a[bn/NINDIRECT]) == 0){
-		a[bn/NINDIRECT] = addr = balloc(ip->dev);
+		a[bn/NINDIRECT] = addr = balloc(ip->dev, ip->addrs[NDIRECT+1] + 1);
 		log_write(bp);
 	}
 	
@@ -422,7 +1054,8 @@ bmap(struct inode *ip, uint bn)
 	bn = bn % NINDIRECT;
 
 	if((addr = d[bn]) == 0){
-		d[bn] = addr = balloc(ip->dev);
+		d[bn] = addr = bdata(ip,
+		  nextgoal(bn ? d[bn-1] : 0, dbp->blockno + 1), fresh);
 		log_write(dbp);
 	}
 
@@ -436,66 +1069,613 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Only called when the inode has no links
-// to it (no directory entries referring to it)
-// and has no in-memory reference to it (is
-// not an open file or current directory).
-static void
-itrunc(struct inode *ip)
+// Return the disk block address of the nth block in inode ip,
+// or 0 if it has none, or one that holds no data yet (see
+// EXT_UNWRITTEN). Unlike bmap(), never allocates.
+static uint
+bmapget(struct inode *ip, uint bn)
 {
-  int i, j;
-  struct buf *bp, *dbp;
-  uint *a, *d;
+  uint addr, goal;
+  int unwritten;
+  struct buf *bp;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  if(ip->flags & I_EXTENT){
+    addr = extlookup(ip, bn, &goal, &unwritten);
+    return unwritten ? 0 : addr;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
 
-  if(ip->addrs[NDIRECT+1]){
-  	bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
-	a = (uint*)bp->data;
-
-	for(i=0; i<NINDIRECT; i++){
-		if(a[i]){
-			dbp = bread(ip->dev, a[i]);
-			d = (uint*)dbp->data;
-			for(j=0; j<NINDIRECT; j++){
-				if(d[j])
-					bfree(ip->dev, d[j]);
-			}
-			brelse(dbp);
-			bfree(ip->dev, a[i]);
-		}
-	}
+  if(bn < NINDIRECT){
+    if((addr = ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  bn -= NINDIRECT;
 
-	brelse(bp);
-	bfree(ip->dev, ip->addrs[NDIRECT+1]);
-	ip->addrs[NDIRECT+1] = 0;
+  if(bn < NDOUBLEINDIRECT){
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn/NINDIRECT];
+    brelse(bp);
+    if(addr == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn%NINDIRECT];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
+// Give blocks bn..bn+n-1 of inode ip, which hold no data,
+// disk blocks to be written: those fallocate() set aside, or
+// new ones, as one contiguous run if possible. Returns the
+// first, and sets *got to how many of the n blocks the run
+// covers. The caller writes all of them (see bdata).
+static uint
+bmaprun(struct inode *ip, uint bn, uint n, uint *got)
+{
+  struct extent e;
+  uint addr, goal, g, k;
+  int fresh, unwritten;
+
+  if(!(ip->flags & I_EXTENT)){
+    *got = 1;
+    return bmap(ip, bn, &fresh);
+  }
+  goal = igoal(ip);
+  if(extlookup(ip, bn, &goal, &unwritten) != 0)
+    return extwritten(ip, bn, n, got);
+  // Stop short of blocks set aside further on.
+  for(k = 1; k < n; k++)
+    if(extlookup(ip, bn+k, &g, &unwritten) != 0)
+      break;
+  addr = bclaimrun(ip->dev, goal, k, got);
+  e.lblk = bn;
+  e.start = addr;
+  e.len = *got;
+  extinsert(ip, &e);
+  return addr;
+}
 
+// The log blocks one step of freeing an inode's blocks may
+// still use for bitmap blocks, and those it has used.
+struct tbudget {
+  int left;
+  int n;
+  uint bmap[TRUNCBLOCKS];
+  uint freed;      // blocks freed so far
+};
+
+// Return how many of the last of the n disk blocks from b
+// the step may free, given the bitmap blocks that takes, and
+// charge for them.
+static uint
+tcharge(struct tbudget *t, uint b, uint n)
+{
+  uint end, lo;
+  int i;
+
+  for(end = b + n; end > b; end = lo){
+    lo = (end - 1) / BPB * BPB;
+    if(lo < b)
+      lo = b;
+    for(i = 0; i < t->n && t->bmap[i] != BBLOCK(end - 1, sb); i++)
+      ;
+    if(i == t->n){
+      if(t->left <= 0)
+        break;
+      t->left--;
+      t->bmap[t->n++] = BBLOCK(end - 1, sb);
+    }
   }
+  t->freed += b + n - end;
+  return b + n - end;
+}
+
+// Free blocks from the end of the level-deep tree of
+// indirect blocks whose root is block *slot, as far as t
+// allows. Returns 1, with *slot cleared, once all are free.
+static int
+indtrunc(struct inode *ip, uint *slot, int level, struct tbudget *t)
+{
+  struct buf *bp;
+  uint *a, freed;
+  int n;
 
-  ip->size = 0;
+  if(*slot == 0)
+    return 1;
+  if(level > 0){
+    bp = bread(ip->dev, *slot);
+    a = (uint*)bp->data;
+    freed = t->freed;
+    for(n = NINDIRECT; n > 0 && indtrunc(ip, &a[n-1], level-1, t); n--)
+      ;
+    if(n > 0 || tcharge(t, *slot, 1) == 0){
+      if(t->freed != freed)
+        log_write(bp);
+      brelse(bp);
+      return 0;
+    }
+    brelse(bp);
+  } else if(tcharge(t, *slot, 1) == 0)
+    return 0;
+  bfree(ip->dev, *slot);
+  *slot = 0;
+  return 1;
+}
+
+// Free up to nblocks log blocks' worth of inode ip's blocks,
+// the last ones first, so that what is left is always a
+// consistent, shorter file. Only called when the inode has
+// no links to it (no directory entries referring to it)
+// and only the caller has a reference to it. Returns 1 once
+// it has no blocks left.
+static int
+itrunc(struct inode *ip, int nblocks)
+{
+  struct tbudget t;
+  struct exthdr *h;
+  int i, done;
+
+  if(ip->type == T_FILE)
+    pdrop(ip->dev, ip->inum);  // unwritten data goes too
+  ip->size = ip->dsize = 0;
+  memset(&t, 0, sizeof(t));
+
+  // The rest of nblocks is for the inode, and for the tree
+  // node at each level that may be left partly freed.
+  if(ip->flags & I_EXTENT){
+    h = (struct exthdr*)ip->addrs;
+    t.left = min(nblocks - 1 - h->depth, TRUNCBLOCKS);
+    if((done = exttrunc(ip, h, &t)) != 0)
+      h->depth = 0;
+  } else {
+    t.left = min(nblocks - 3, TRUNCBLOCKS);
+    done = indtrunc(ip, &ip->addrs[NDIRECT+1], 2, &t) &&
+           indtrunc(ip, &ip->addrs[NDIRECT], 1, &t);
+    for(i = NDIRECT; done && i > 0; i--)
+      done = indtrunc(ip, &ip->addrs[i-1], 0, &t);
+  }
   iupdate(ip);
+  return done;
+}
+
+//PAGEBREAK!
+// Extents
+//
+// An extent-mapped inode keeps the root of its extent tree
+// in ip->addrs. Finding a block costs one read per tree
+// level, and none for a file of a few runs. Appending a
+// block that is contiguous with the last run just bumps the
+// run's length, so a large file written sequentially stays
+// a handful of extents and truncating it touches only the
+// bitmap blocks that cover it.
+
+// A node of an extent tree: either the root embedded in
+// the inode (bp == 0) or a disk block in the buffer cache.
+struct extnode {
+  struct buf *bp;
+  struct exthdr *hdr;
+};
+
+#define EXTENTS(h) ((struct extent*)((h)+1))
+#define EXTIDXS(h) ((struct extidx*)((h)+1))
+
+static void
+extroot(struct inode *ip, struct extnode *n)
+{
+  n->bp = 0;
+  n->hdr = (struct exthdr*)ip->addrs;
+}
+
+static void
+extload(struct inode *ip, uint blk, struct extnode *n)
+{
+  n->bp = bread(ip->dev, blk);
+  n->hdr = (struct exthdr*)n->bp->data;
+}
+
+// Record a modified node. Changes to the root reach the
+// disk with the caller's iupdate(), as for addrs[].
+static void
+extdirty(struct extnode *n)
+{
+  if(n->bp)
+    log_write(n->bp);
+}
+
+// Maximum number of entries node n can hold.
+static int
+extmax(struct extnode *n)
+{
+  uint sz = n->bp ? BSIZE : EXTROOTSZ;
+  return n->hdr->depth ? NEXTIDX(sz) : NEXT(sz);
+}
+
+static int
+extentsz(struct exthdr *h)
+{
+  return h->depth ? sizeof(struct extidx) : sizeof(struct extent);
+}
+
+// Return the index of the last entry of node h whose lblk
+// is <= bn, or -1 if there is none. Both kinds of entry
+// start with lblk.
+static int
+extfind(struct exthdr *h, uint bn)
+{
+  int lo, hi, mid, sz;
+  char *base;
+
+  sz = extentsz(h);
+  base = (char*)(h+1);
+  lo = 0;
+  hi = h->nent - 1;
+  while(lo <= hi){
+    mid = (lo + hi) / 2;
+    if(*(uint*)(base + mid*sz) <= bn)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return hi;
+}
+
+// Insert entry e at position at of node h, which must have room.
+static void
+extinsent(struct exthdr *h, int at, void *e)
+{
+  int sz;
+  char *base;
+
+  sz = extentsz(h);
+  base = (char*)(h+1);
+  memmove(base + (at+1)*sz, base + at*sz, (h->nent - at)*sz);
+  memmove(base + at*sz, e, sz);
+  h->nent++;
+}
+
+// Return the disk block holding file block bn, or 0 if
+// no extent covers it. In that case *goal is set to where
+// bn would sit if the run before it continued. Sets
+// *unwritten if the extent is unwritten.
+static uint
+extlookup(struct inode *ip, uint bn, uint *goal, int *unwritten)
+{
+  struct extnode n;
+  struct extent *e;
+  uint blk;
+  int i;
+
+  extroot(ip, &n);
+  while(n.hdr->depth > 0){
+    if((i = extfind(n.hdr, bn)) < 0)
+      i = 0;
+    blk = EXTIDXS(n.hdr)[i].blk;
+    if(n.bp)
+      brelse(n.bp);
+    extload(ip, blk, &n);
+  }
+  blk = 0;
+  *unwritten = 0;
+  e = EXTENTS(n.hdr);
+  i = extfind(n.hdr, bn);
+  if(i >= 0){
+    if(bn - e[i].lblk < EXTLEN(&e[i])){
+      blk = e[i].start + (bn - e[i].lblk);
+      *unwritten = (e[i].len & EXT_UNWRITTEN) != 0;
+    } else
+      *goal = e[i].start + (bn - e[i].lblk);
+  }
+  if(n.bp)
+    brelse(n.bp);
+  return blk;
+}
+
+// Add extent ne, whose file blocks must be unmapped. If it
+// continues a neighbouring run of the same kind on disk,
+// that run grows instead of a new extent being added. Full
+// nodes are split on the way back up; a full root moves into
+// a new block and the tree grows one level.
+static void
+extinsert(struct inode *ip, struct extent *ne)
+{
+  struct extnode path[EXTMAXDEPTH+1], nn;
+  struct exthdr *h;
+  struct extent *e;
+  struct extidx xe;
+  int pos[EXTMAXDEPTH+1];
+  int d, leaf, i, at, mid, sz;
+  void *ent;
+  uint nb, bn, len, flag;
+
+  bn = ne->lblk;
+  len = EXTLEN(ne);
+  flag = ne->len & EXT_UNWRITTEN;
+
+  extroot(ip, &path[0]);
+  for(d = 0; path[d].hdr->depth > 0; d++){
+    if(d == EXTMAXDEPTH)
+      panic("extinsert: tree too deep");
+    if((i = extfind(path[d].hdr, bn)) < 0)
+      i = 0;
+    pos[d] = i;
+    extload(ip, EXTIDXS(path[d].hdr)[i].blk, &path[d+1]);
+  }
+  leaf = d;
+
+  e = EXTENTS(path[leaf].hdr);
+  i = extfind(path[leaf].hdr, bn);
+  if(i >= 0 && (e[i].len & EXT_UNWRITTEN) == flag &&
+     e[i].lblk + EXTLEN(&e[i]) == bn && e[i].start + EXTLEN(&e[i]) == ne->start){
+    e[i].len += len;
+    extdirty(&path[leaf]);
+    goto done;
+  }
+  if(i+1 < path[leaf].hdr->nent && (e[i+1].len & EXT_UNWRITTEN) == flag &&
+     e[i+1].lblk == bn+len && e[i+1].start == ne->start+len){
+    e[i+1].lblk -= len;
+    e[i+1].start -= len;
+    e[i+1].len += len;
+    extdirty(&path[leaf]);
+    goto done;
+  }
+
+  ent = ne;
+  at = i + 1;
+  for(d = leaf; ; d--){
+    h = path[d].hdr;
+    if(h->nent < extmax(&path[d])){
+      extinsent(h, at, ent);
+      extdirty(&path[d]);
+      goto done;
+    }
+
+    sz = extentsz(h);
+    nb = balloc(ip->dev, path[d].bp ? path[d].bp->blockno + 1 : igoal(ip));
+    extload(ip, nb, &nn);
+    if(d == 0){
+      // Full root: push its entries down into the new block.
+      memmove(nn.hdr, h, sizeof(*h) + h->nent*sz);
+      extinsent(nn.hdr, at, ent);
+      log_write(nn.bp);
+      h->depth++;
+      h->nent = 1;
+      EXTIDXS(h)[0].lblk = *(uint*)(nn.hdr+1);
+      EXTIDXS(h)[0].blk = nb;
+      brelse(nn.bp);
+      goto done;
+    }
+
+    // Split a full block. An append starts an empty sibling
+    // so that trees built sequentially stay packed; any other
+    // insert moves the upper half across.
+    mid = (at == h->nent) ? h->nent : h->nent/2;
+    nn.hdr->depth = h->depth;
+    nn.hdr->nent = h->nent - mid;
+    memmove(nn.hdr+1, (char*)(h+1) + mid*sz, nn.hdr->nent*sz);
+    h->nent = mid;
+    if(at >= mid)
+      extinsent(nn.hdr, at - mid, ent);
+    else
+      extinsent(h, at, ent);
+    extdirty(&path[d]);
+    log_write(nn.bp);
+    xe.lblk = *(uint*)(nn.hdr+1);
+    xe.blk = nb;
+    brelse(nn.bp);
+    ent = &xe;
+    at = pos[d-1] + 1;
+  }
+
+done:
+  for(d = 1; d <= leaf; d++)
+    brelse(path[d].bp);
+}
+
+// bmap() for extent-mapped inodes.
+static uint
+extbmap(struct inode *ip, uint bn, int *fresh)
+{
+  struct extent e;
+  uint addr, goal;
+  int unwritten;
+
+  goal = igoal(ip);
+  if((addr = extlookup(ip, bn, &goal, &unwritten)) == 0){
+    addr = bdata(ip, goal, fresh);
+    e.lblk = bn;
+    e.start = addr;
+    e.len = 1;
+    extinsert(ip, &e);
+  } else if(unwritten)
+    panic("extbmap: unwritten");  // only regular files preallocate
+  return addr;
+}
+
+// Mark file blocks bn..bn+n-1, the first of them in an
+// unwritten extent, as holding data, up to the end of that
+// extent. Returns the first one's disk block and sets *got
+// to how many blocks it covered. The written part moves to an
+// extent of its own, which joins the written run before it
+// when it can, so a file written into space set aside for it
+// ends up as few extents as if it had been allocated then.
+static uint
+extwritten(struct inode *ip, uint bn, uint n, uint *got)
+{
+  struct extnode path[EXTMAXDEPTH+1];
+  struct extent *e, old, w, rest;
+  uint end;
+  int d, i;
+
+  extroot(ip, &path[0]);
+  for(d = 0; path[d].hdr->depth > 0; d++){
+    if((i = extfind(path[d].hdr, bn)) < 0)
+      i = 0;
+    extload(ip, EXTIDXS(path[d].hdr)[i].blk, &path[d+1]);
+  }
+  e = EXTENTS(path[d].hdr);
+  if((i = extfind(path[d].hdr, bn)) < 0 || (e[i].len & EXT_UNWRITTEN) == 0 ||
+     bn - e[i].lblk >= EXTLEN(&e[i]))
+    panic("extwritten");
+  old = e[i];
+  end = old.lblk + EXTLEN(&old);
+  if(n > end - bn)
+    n = end - bn;
+
+  // Keep the unwritten part before bn in place, or remove the
+  // entry; the unwritten part after goes back in separately.
+  if(bn > old.lblk){
+    e[i].len = (bn - old.lblk) | EXT_UNWRITTEN;
+  } else {
+    memmove(&e[i], &e[i+1], (path[d].hdr->nent - i - 1)*sizeof(*e));
+    path[d].hdr->nent--;
+  }
+  extdirty(&path[d]);
+  for(; d > 0; d--)
+    brelse(path[d].bp);
+
+  if(bn + n < end){
+    rest.lblk = bn + n;
+    rest.start = old.start + (bn + n - old.lblk);
+    rest.len = (end - (bn + n)) | EXT_UNWRITTEN;
+    extinsert(ip, &rest);
+  }
+  w.lblk = bn;
+  w.start = old.start + (bn - old.lblk);
+  w.len = n;
+  extinsert(ip, &w);
+  *got = n;
+  return w.start;
+}
+
+// Free blocks from the end of the extent tree below node h
+// as far as t allows, logging the nodes that change but
+// stay. Returns 1 if h is left empty; the caller then frees
+// it, or must log it.
+static int
+exttrunc(struct inode *ip, struct exthdr *h, struct tbudget *t)
+{
+  struct buf *bp;
+  struct extent *e;
+  struct extidx *x;
+  uint k, freed;
+  int empty;
+
+  while(h->nent > 0){
+    if(h->depth == 0){
+      e = &EXTENTS(h)[h->nent-1];
+      if((k = tcharge(t, e->start, EXTLEN(e))) == 0)
+        return 0;
+      bfreerun(ip->dev, e->start + EXTLEN(e) - k, k);
+      e->len -= k;
+      if(EXTLEN(e) > 0)
+        return 0;
+    } else {
+      x = &EXTIDXS(h)[h->nent-1];
+      bp = bread(ip->dev, x->blk);
+      freed = t->freed;
+      empty = exttrunc(ip, (struct exthdr*)bp->data, t);
+      if(!empty || tcharge(t, x->blk, 1) == 0){
+        if(t->freed != freed)
+          log_write(bp);
+        brelse(bp);
+        return 0;
+      }
+      brelse(bp);
+      bfree(ip->dev, x->blk);
+    }
+    h->nent--;
+  }
+  return 1;
+}
+
+// Number of blocks in the extent tree below node h, its
+// own index blocks included.
+static uint
+extcount(struct inode *ip, struct exthdr *h)
+{
+  struct buf *bp;
+  struct extent *e;
+  struct extidx *x;
+  uint n;
+  int i;
+
+  n = 0;
+  if(h->depth == 0){
+    e = EXTENTS(h);
+    for(i = 0; i < h->nent; i++)
+      n += EXTLEN(&e[i]);
+    return n;
+  }
+  x = EXTIDXS(h);
+  for(i = 0; i < h->nent; i++){
+    bp = bread(ip->dev, x[i].blk);
+    n += 1 + extcount(ip, (struct exthdr*)bp->data);
+    brelse(bp);
+  }
+  return n;
+}
+
+// Number of non-zero addresses in a[0..n-1].
+static uint
+addrcount(uint *a, int n)
+{
+  uint c;
+  int i;
+
+  c = 0;
+  for(i = 0; i < n; i++)
+    if(a[i])
+      c++;
+  return c;
+}
+
+// Number of disk blocks ip holds, indirect and index blocks
+// included. Holes have none, and neither do pages not yet
+// written back.
+static uint
+icount(struct inode *ip)
+{
+  struct buf *bp, *dbp;
+  uint n, *a;
+  int i;
+
+  if(ip->flags & I_EXTENT)
+    return extcount(ip, (struct exthdr*)ip->addrs);
+
+  n = addrcount(ip->addrs, NDIRECT);
+  if(ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    n += 1 + addrcount((uint*)bp->data, NINDIRECT);
+    brelse(bp);
+  }
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    a = (uint*)bp->data;
+    n++;
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == 0)
+        continue;
+      dbp = bread(ip->dev, a[i]);
+      n += 1 + addrcount((uint*)dbp->data, NINDIRECT);
+      brelse(dbp);
+    }
+    brelse(bp);
+  }
+  return n;
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, shared or exclusive.
 void
 stati(struct inode *ip, struct stat *st)
 {
@@ -504,32 +1684,392 @@ stati(struct inode *ip, struct stat *st)
   st->type = ip->type;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  st->blocks = ip->type == T_DEV ? 0 : icount(ip);
+}
+
+//PAGEBREAK!
+// File pages
+//
+// A regular file's data is read and written in the page
+// cache (pcache.c). Its blocks are only touched to fill a
+// page from the disk and, through iflush(), to write dirty
+// pages back. Blocks for file data new on disk are allocated
+// in iflush(): a batch of pages written in order usually gets
+// one contiguous run, that is one extent and one disk request.
+//
+// ip->dsize is the size recorded on disk. It trails ip->size
+// while the end of the file is only in the page cache, and
+// catches up as iflush() writes the pages, in the same
+// transaction. So, as in ordered mode (see log.c), the disk
+// never holds a size covering data that is not there. iget()
+// does not recycle an inode whose sizes differ.
+
+#define FLUSHPAGES 8  // most pages iflush() writes per transaction
+// Log blocks a batch of n pages may need: for each block
+// itself, if it must be journaled, a bitmap block and an
+// extent leaf; and the inode and an extent split at each level.
+#define FLUSHBLOCKS(n) ((n)*3*PGBLOCKS + 1 + 3*EXTMAXDEPTH)
+
+// Number of blocks that hold file data up to ip->size.
+static uint
+iblocks(struct inode *ip)
+{
+  return ip->size/BSIZE + (ip->size%BSIZE != 0);
+}
+
+// Read page pg of file ip from disk, a request per run of
+// contiguous blocks. Blocks past the end of the file or
+// without a disk block read as zeroes.
+static void
+pfill(struct inode *ip, struct page *pg)
+{
+  struct buf *bv[PGBLOCKS];
+  uint addr[PGBLOCKS], bn, end;
+  int i, j, k;
+
+  bn = pg->pgno * PGBLOCKS;
+  end = iblocks(ip);
+  for(i = 0; i < PGBLOCKS; i++)
+    addr[i] = bn + i < end ? bmapget(ip, bn + i) : 0;
+  for(i = 0; i < PGBLOCKS; i = j){
+    if(addr[i] == 0){
+      memset(pg->data + i*BSIZE, 0, BSIZE);
+      j = i + 1;
+      continue;
+    }
+    for(j = i + 1; j < PGBLOCKS && addr[j] == addr[j-1] + 1; j++)
+      ;
+    breadv(ip->dev, addr[i], j - i, bv);
+    for(k = 0; k < j - i; k++){
+      memmove(pg->data + (i+k)*BSIZE, bv[k]->data, BSIZE);
+      brelse(bv[k]);
+    }
+  }
+  pg->flags |= P_VALID;
+}
+
+// Is slot i of a batch of pages pv, block i%PGBLOCKS of page
+// pv[i/PGBLOCKS], all zeroes?
+static int
+zeroblock(struct page **pv, int i)
+{
+  uint *p;
+  int k;
+
+  p = (uint*)(pv[i/PGBLOCKS]->data + (i%PGBLOCKS)*BSIZE);
+  for(k = 0; k < BSIZE/sizeof(uint); k++)
+    if(p[k] != 0)
+      return 0;
+  return 1;
+}
+
+// Write up to max of ip's dirty pages to disk, lowest first,
+// and return how many there were. Caller holds ip->lock
+// exclusively, inside a transaction of FLUSHBLOCKS(max).
+static int
+iflushsome(struct inode *ip, int max)
+{
+  struct page *pv[FLUSHPAGES];
+  struct buf *bv[FLUSHPAGES*PGBLOCKS];
+  uint addr[FLUSHPAGES*PGBLOCKS];
+  uint end, bn, got, last, dsize;
+  int n, i, j, k, changed;
+
+  if((n = pdirtyv(ip->dev, ip->inum, pv, max)) == 0)
+    return 0;
+
+  // Find each block's disk address; slot i is block i%PGBLOCKS
+  // of page pv[i/PGBLOCKS]. Blocks past the end get none.
+  end = iblocks(ip);
+  for(i = 0; i < n*PGBLOCKS; i++){
+    bn = pv[i/PGBLOCKS]->pgno*PGBLOCKS + i%PGBLOCKS;
+    addr[i] = bn < end ? bmapget(ip, bn) : 0;
+  }
+
+  // Allocate the blocks that have none, a run per stretch of
+  // consecutive file blocks. Blocks of zeroes stay holes.
+  changed = 0;
+  for(i = 0; i < n*PGBLOCKS; i += got){
+    bn = pv[i/PGBLOCKS]->pgno*PGBLOCKS + i%PGBLOCKS;
+    got = 1;
+    if(addr[i] != 0 || bn >= end || zeroblock(pv, i))
+      continue;
+    for(j = i + 1; j < n*PGBLOCKS && addr[j] == 0 &&
+        pv[j/PGBLOCKS]->pgno*PGBLOCKS + j%PGBLOCKS == bn + (j - i) &&
+        bn + (j - i) < end && !zeroblock(pv, j); j++)
+      ;
+    addr[i] = bmaprun(ip, bn, j - i, &got);
+    changed = 1;
+    for(k = 1; k < got; k++)
+      addr[i+k] = addr[i] + k;
+  }
+
+  // Write each run of contiguous disk blocks with one request.
+  for(i = 0; i < n*PGBLOCKS; i = j){
+    if(addr[i] == 0){
+      j = i + 1;
+      continue;
+    }
+    for(j = i; j < n*PGBLOCKS && addr[j] == addr[i] + (j - i); j++){
+      bv[j-i] = bnew(ip->dev, addr[j]);
+      memmove(bv[j-i]->data, pv[j/PGBLOCKS]->data + (j%PGBLOCKS)*BSIZE, BSIZE);
+    }
+    if(log_writedatav(bv, j - i) > 0)
+      changed = 1;  // journaled: durable only at commit
+    for(k = 0; k < j - i; k++)
+      brelse(bv[k]);
+  }
+
+  // The disk now holds the file up to the end of the last page,
+  // since everything before it was written earlier or now.
+  // Overwriting blocks in place logs nothing, and then the
+  // data is durable already; fdatasync() need not wait.
+  last = pv[n-1]->pgno;
+  dsize = ip->dsize;
+  if(last >= (ip->size - 1) / PGSIZE)
+    ip->dsize = ip->size;
+  else if(ip->dsize < (last + 1) * PGSIZE)
+    ip->dsize = (last + 1) * PGSIZE;
+  if(changed || ip->dsize != dsize){
+    iupdate(ip);
+    ip->datatid = log_tid();
+  }
+
+  for(i = 0; i < n; i++){
+    pclean(pv[i]);
+    pput(pv[i]);
+  }
+  return n;
+}
+
+// Write all of ip's dirty pages to disk, a batch per
+// transaction. ip must be referenced but not locked, and
+// the caller must not be in a transaction.
+void
+iflush(struct inode *ip)
+{
+  int max, n;
+
+  max = FLUSHPAGES;
+  while(max > 1 && FLUSHBLOCKS(max) > log_opmax())
+    max--;
+  do {
+    begin_op(min(FLUSHBLOCKS(max), log_opmax()));
+    // Not ilock(): the writeback thread may find the
+    // inode freed.
+    acquiresleep(&ip->lock);
+    if(ip->valid == 0)
+      iload(ip);
+    n = 0;
+    if(ip->valid && ip->type == T_FILE)
+      n = iflushsome(ip, max);
+    releasesleep(&ip->lock);
+    end_op();
+  } while(n > 0);
+}
+
+// Write back the dirty pages of inode inum on device dev.
+// Called by the writeback thread, which has no reference
+// to the inode, which may since have been freed.
+void
+iwriteback(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  ip = iget(dev, inum);
+  iflush(ip);
+  begin_op(IPUTBLOCKS);
+  iput(ip);
+  end_op();
+}
+
+// Zero the rest of regular file ip's last page, past its
+// end, before the file grows over it: mmap() may have stored
+// there. Caller holds ip->lock exclusively.
+static void
+pzerotail(struct inode *ip)
+{
+  struct page *pg;
+
+  if(ip->size % PGSIZE == 0)
+    return;
+  pg = pget(ip->dev, ip->inum, ip->size/PGSIZE);
+  if((pg->flags & P_VALID) == 0)
+    pfill(ip, pg);
+  memset(pg->data + ip->size%PGSIZE, 0, PGSIZE - ip->size%PGSIZE);
+  pdirty(pg);
+  pput(pg);
+}
+
+// Log blocks preallocating n runs may need: for each, a
+// bitmap block and an extent split at each level; and the inode.
+#define FALLOCBLOCKS(n) (1 + (n)*(1 + 2*EXTMAXDEPTH + 1))
+
+// Set aside blocks for up to max runs of file blocks of ip
+// from bytes [off, off+len), and return how many bytes of
+// the range are now done, or -1 if the disk is full. Caller
+// holds ip->lock exclusively, inside a transaction of
+// FALLOCBLOCKS(max).
+static int
+fallocsome(struct inode *ip, uint off, uint len, int max)
+{
+  struct extent e;
+  uint bn, end, k, goal, g, done, avail;
+  int runs, unwritten;
+
+  bn = off / BSIZE;
+  end = off/BSIZE + (off%BSIZE + len + BSIZE - 1) / BSIZE;
+  for(runs = 0; bn < end && runs < max; runs++){
+    // Skip blocks that have one, then take the rest of the
+    // hole, up to a group's worth.
+    goal = igoal(ip);
+    while(bn < end && extlookup(ip, bn, &goal, &unwritten) != 0)
+      bn++;
+    if(bn == end)
+      break;
+    for(k = 1; bn + k < end && k < BPB; k++)
+      if(extlookup(ip, bn + k, &g, &unwritten) != 0)
+        break;
+    // Fail rather than run out, leaving room for the
+    // extent tree to grow.
+    if((avail = bavail()) < k + EXTMAXDEPTH + 1)
+      k = avail > EXTMAXDEPTH + 1 ? avail - (EXTMAXDEPTH + 1) : 0;
+    if(k == 0){
+      iupdate(ip);
+      return -1;
+    }
+    e.lblk = bn;
+    e.start = bclaimrun(ip->dev, goal, k, &k);
+    e.len = k | EXT_UNWRITTEN;
+    extinsert(ip, &e);
+    bn += k;
+  }
+
+  done = bn*BSIZE - off;
+  if(bn*BSIZE < off || done > len)
+    done = len;
+  if(off + done > ip->size){
+    // Unwritten blocks and holes read as zeroes, so the disk
+    // may hold this size at once.
+    pzerotail(ip);
+    ip->size = ip->dsize = off + done;
+  }
+  iupdate(ip);
+  ip->datatid = log_tid();
+  return done;
+}
+
+// Preallocate disk blocks for bytes [off, off+len) of regular
+// file ip, in as few transactions and contiguous runs as will
+// hold them. The blocks are allocated but not zeroed: they are
+// unwritten extents, which read as zeroes until written back
+// (see bmaprun), so writing them later allocates nothing. The
+// file grows to off+len if it is smaller. ip must be referenced
+// but not locked, and the caller must not be in a transaction.
+// Returns 0, or -1 if ip can't be preallocated or the disk
+// hasn't room; the blocks set aside before the disk filled up
+// stay with the file.
+int
+ifallocate(struct inode *ip, uint off, uint len)
+{
+  uint nb;
+  int max, done;
+
+  if(off + len < off)
+    return -1;
+  nb = (off%BSIZE + len + BSIZE - 1) / BSIZE;
+  max = (log_opmax() - 1) / (1 + 2*EXTMAXDEPTH + 1);
+  do {
+    begin_op(FALLOCBLOCKS(max));
+    ilock(ip);
+    done = -1;
+    // Turn down at once a range larger than the free space
+    // and all of the file's own blocks.
+    if(ip->type == T_FILE && (ip->flags & I_EXTENT) && nb <= bavail() + icount(ip))
+      done = fallocsome(ip, off, len, max);
+    iunlock(ip);
+    end_op();
+    if(done < 0)
+      return -1;
+    nb = 0;
+    off += done;
+    len -= done;
+  } while(len > 0);
+  return 0;
+}
+
+// Return page pgno of regular file ip holding its data and
+// pinned (see ppin), but not locked, or 0 if the page lies
+// past the end of the file. For mmap faults and sendfile().
+struct page*
+ipage(struct inode *ip, uint pgno)
+{
+  struct page *pg;
+
+  ilockshared(ip);
+  if(ip->size == 0 || pgno > (ip->size - 1) / PGSIZE){
+    iunlockshared(ip);
+    return 0;
+  }
+  pg = pget(ip->dev, ip->inum, pgno);
+  if((pg->flags & P_VALID) == 0)
+    pfill(ip, pg);
+  ppin(pg);
+  pput(pg);
+  iunlockshared(ip);
+  return pg;
 }
 
 //PAGEBREAK!
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, shared or exclusive. Devices
+// can only be read with it exclusive, since their read
+// functions may drop and retake it (see consoleread).
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
+  struct page *pg;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
       return -1;
+    if(!holdingsleep(&ip->lock))
+      return -1;
     return devsw[ip->major].read(ip, dst, n);
   }
 
-  if(off > ip->size || off + n < off)
+  if(off + n < off)
     return -1;
+  if(off > ip->size)  // a file read past its end, as after lseek(), finds nothing
+    return ip->type == T_FILE ? 0 : -1;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(ip->type == T_FILE){
+    for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+      pg = pget(ip->dev, ip->inum, off/PGSIZE);
+      if((pg->flags & P_VALID) == 0)
+        pfill(ip, pg);
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      memmove(dst, pg->data + off%PGSIZE, m);
+      pput(pg);
+    }
+    return n;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
+    if((addr = bmapget(ip, off/BSIZE)) == 0){
+      memset(dst, 0, m);  // a hole
+      continue;
+    }
+    bp = bread(ip->dev, addr);
+    if((ip->flags & I_HTREE) && ((struct htnode*)bp->data)->magic == HTMAGIC)
+      memset(dst, 0, m);  // index node: show as unused dirents
+    else
+      memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
   return n;
@@ -538,11 +2078,19 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
+// A regular file's data only goes into its pages here, and
+// its size grows only in memory: iflush() later allocates
+// blocks for the pages, writes them and updates the inode.
+// A regular file may be written past its end, leaving a hole
+// that reads as zeroes and has no blocks.
+// Other content is written to its blocks and logged.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
+  int fresh;
   struct buf *bp;
+  struct page *pg;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
@@ -550,18 +2098,42 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return devsw[ip->major].write(ip, src, n);
   }
 
-  if(off > ip->size || off + n < off)
+  if((off > ip->size && ip->type != T_FILE) || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(!(ip->flags & I_EXTENT) && off + n > MAXFILE*BSIZE)
     return -1;
 
+  if(ip->type == T_FILE){
+    if(n > 0 && off > ip->size)
+      pzerotail(ip);
+    for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+      pg = pget(ip->dev, ip->inum, off/PGSIZE);
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      if((pg->flags & P_VALID) == 0 && m < PGSIZE)
+        pfill(ip, pg);
+      memmove(pg->data + off%PGSIZE, src, m);
+      pg->flags |= P_VALID;
+      pdirty(pg);
+      pput(pg);
+    }
+    if(n > 0 && off > ip->size)
+      ip->size = off;
+    return n;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    fresh = 0;
+    addr = bmap(ip, off/BSIZE, &fresh);
+    // A new block's old contents don't matter: start from
+    // zeroes rather than reading it.
+    bp = fresh ? bnew(ip->dev, addr) : bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    log_write(bp);  // directory content is metadata
     brelse(bp);
   }
+  if(n > 0)
+    ip->datatid = log_tid();
 
   if(n > 0 && off > ip->size){
     ip->size = off;
@@ -579,35 +2151,577 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory entry cache.
+//
+// dcache remembers what recent dirlookup() scans found: the
+// inum and offset of name in directory dir or, with inum 0,
+// that dir has no entry name. Entries are hashed on (dev,
+// dir, name) and recycled least recently used first.
+// Directory entries change only in dirlink() and sys_unlink(),
+// with the directory locked, and both update the cache with
+// dcacheset(); so the cache entries of a locked directory are
+// exact. A freed directory's entries are dropped, since its
+// inum may be reused.
+
+#define NDENTRY 256
+#define NDHASH  61
+
+struct dentry {
+  uint dev;
+  uint dir;       // 0 if unused
+  char name[DIRSIZ];
+  uint inum;      // 0 if dir has no entry name
+  uint off;       // byte offset of the entry in dir
+  struct dentry *hnext;  // hash chain
+  struct dentry *prev;   // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  struct dentry head;  // head.next is most recently used
+} dcache;
+
+static void
+dinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+static uint
+dhash(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*33 + name[i];
+  return h % NDHASH;
+}
+
+// Move d to the front (front != 0) or back of the LRU list.
+static void
+dmove(struct dentry *d, int front)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  if(front){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+  } else {
+    d->next = &dcache.head;
+    d->prev = dcache.head.prev;
+  }
+  d->next->prev = d;
+  d->prev->next = d;
+}
+
+// Take d off its hash chain and mark it unused.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  if(d->dir == 0)
+    return;
+  for(pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  d->dir = 0;
+}
+
+// Find the entry for name in dp. Caller holds dcache.lock.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dp->dev, dp->inum, name)]; d; d = d->hnext){
+    if(d->dev == dp->dev && d->dir == dp->inum && namecmp(d->name, name) == 0){
+      dmove(d, 1);
+      return d;
+    }
+  }
+  return 0;
+}
+
+// Record that name in dp is inum at off, or absent if inum
+// is 0. Caller must hold dp->lock, shared or exclusive.
+static void
+dcacheset(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    d = dcache.head.prev;
+    dunhash(d);
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[dhash(d->dev, d->dir, d->name)];
+    dcache.hash[dhash(d->dev, d->dir, d->name)] = d;
+    dmove(d, 1);
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Drop the entries of directory dir, which is being freed.
+static void
+dcachepurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    if(d->dir == dir && d->dev == dev){
+      dunhash(d);
+      dmove(d, 0);
+    }
+  }
+  release(&dcache.lock);
+}
+
+// Hash of a directory entry name, for indexed directories.
+// mkfs.c has a copy.
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+#define HTENTS(x) ((struct htent*)((x)+1))
+
+// Return a locked buffer holding block lblk of directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint lblk)
+{
+  uint addr;
+
+  if((addr = bmapget(dp, lblk)) == 0)
+    panic("dirblock");
+  return bread(dp->dev, addr);
+}
+
+// Add a zeroed block to the end of directory dp.
+// Returns its block number within dp.
+static uint
+dirgrow(struct inode *dp)
+{
+  uint lblk;
+
+  lblk = dp->size / BSIZE;
+  bmap(dp, lblk, 0);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return lblk;
+}
+
+// Index of the entry of node x whose child covers hash h.
+static int
+htfind(struct htnode *x, uint h)
+{
+  struct htent *e;
+  int lo, hi, mid;
+
+  e = HTENTS(x);
+  lo = 0;
+  hi = x->n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Walk the index of dp from the root towards hash h. Records
+// in path[] and pos[] the block of each index node on the way
+// and the entry taken there, and returns the leaf's block.
+// Sets *nlevel to the number of index levels, and *full if
+// every node on the path is full.
+static uint
+htwalk(struct inode *dp, uint h, uint *path, int *pos, int *nlevel, int *full)
+{
+  struct buf *bp;
+  struct htnode *x;
+  uint lblk;
+  int k, depth;
+
+  lblk = 0;
+  *full = 1;
+  for(k = 0; ; k++){
+    bp = dirblock(dp, lblk);
+    x = (struct htnode*)bp->data;
+    if(x->magic != HTMAGIC || x->n == 0 || x->depth >= HTMAXDEPTH)
+      panic("htwalk: bad index");
+    depth = x->depth;
+    path[k] = lblk;
+    pos[k] = htfind(x, h);
+    if(x->n < NHTENT)
+      *full = 0;
+    lblk = HTENTS(x)[pos[k]].blk;
+    brelse(bp);
+    if(depth == 0){
+      *nlevel = k + 1;
+      return lblk;
+    }
+  }
+}
+
+// Insert (hash, blk) at entry at of node x.
+static void
+htins(struct htnode *x, int at, uint hash, uint blk)
+{
+  struct htent *e;
+
+  e = HTENTS(x);
+  memmove(e+at+1, e+at, (x->n - at) * sizeof(*e));
+  e[at].hash = hash;
+  e[at].blk = blk;
+  x->n++;
+}
+
+// Split the full index node in bp, inserting (hash, blk) at
+// entry at on the way. Sets *sep and *nb to the lowest hash
+// and block of the new right half. Releases bp.
+static void
+htsplit(struct inode *dp, struct buf *bp, int at, uint hash, uint blk,
+        uint *sep, uint *nb)
+{
+  struct buf *nbp;
+  struct htnode *x, *y;
+  int half;
+
+  *nb = dirgrow(dp);
+  nbp = dirblock(dp, *nb);
+  x = (struct htnode*)bp->data;
+  y = (struct htnode*)nbp->data;
+  half = NHTENT / 2;
+  y->magic = HTMAGIC;
+  y->depth = x->depth;
+  y->n = x->n - half;
+  y->count = 0;
+  memmove(HTENTS(y), HTENTS(x)+half, y->n * sizeof(struct htent));
+  x->n = half;
+  if(at <= half)
+    htins(x, at, hash, blk);
+  else
+    htins(y, at - half, hash, blk);
+  *sep = HTENTS(y)[0].hash;
+  log_write(bp);
+  log_write(nbp);
+  brelse(nbp);
+  brelse(bp);
+}
+
+// Add child (hash, blk) to the index node at level k of the
+// path, after the entry the path took there, splitting nodes
+// as needed. A full root moves down a level, so the tree
+// grows at the top. The caller has checked there is room.
+static void
+htaddidx(struct inode *dp, uint *path, int *pos, int k, uint hash, uint blk)
+{
+  struct buf *bp, *nbp;
+  struct htnode *x;
+  uint sep, nb;
+
+  bp = dirblock(dp, path[k]);
+  x = (struct htnode*)bp->data;
+  if(x->n < NHTENT){
+    htins(x, pos[k]+1, hash, blk);
+    log_write(bp);
+    brelse(bp);
+    return;
+  }
+  if(k > 0){
+    htsplit(dp, bp, pos[k]+1, hash, blk, &sep, &nb);
+    htaddidx(dp, path, pos, k-1, sep, nb);
+    return;
+  }
+
+  // Move the root's entries to a new node below it.
+  nb = dirgrow(dp);
+  nbp = dirblock(dp, nb);
+  memmove(nbp->data, bp->data, BSIZE);
+  ((struct htnode*)nbp->data)->count = 0;
+  x->depth++;
+  x->n = 1;
+  HTENTS(x)[0].hash = 0;
+  HTENTS(x)[0].blk = nb;
+  log_write(bp);
+  brelse(bp);
+  htsplit(dp, nbp, pos[0]+1, hash, blk, &sep, &nb);
+  bp = dirblock(dp, 0);
+  htins((struct htnode*)bp->data, 1, sep, nb);
+  log_write(bp);
+  brelse(bp);
+}
+
+// Change the root's count of names by d.
+static void
+htcount(struct inode *dp, int d)
+{
+  struct buf *bp;
+
+  bp = dirblock(dp, 0);
+  ((struct htnode*)bp->data)->count += d;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Look up name in indexed directory dp.
+// Returns its inum and sets *poff, or returns 0.
+static uint
+htlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint path[HTMAXDEPTH], lblk, inum;
+  int pos[HTMAXDEPTH], nlevel, full, i;
+  struct buf *bp;
+  struct dirent *de;
+
+  lblk = htwalk(dp, dirhash(name), path, pos, &nlevel, &full);
+  bp = dirblock(dp, lblk);
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      inum = de[i].inum;
+      *poff = lblk*BSIZE + i*sizeof(*de);
+      brelse(bp);
+      return inum;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Add (name, inum) to indexed directory dp. A full leaf is
+// split at a hash value, so all names with one hash stay in
+// one leaf. Returns the entry's offset, or -1 if the leaf is
+// all one hash or the tree cannot grow.
+static int
+htinsert(struct inode *dp, char *name, uint inum)
+{
+  uint path[HTMAXDEPTH], h, hv[DPB], lblk, nlblk, sep, t;
+  int pos[HTMAXDEPTH], nlevel, full, i, j;
+  struct buf *bp, *nbp;
+  struct dirent *de, *nde;
+
+  h = dirhash(name);
+  lblk = htwalk(dp, h, path, pos, &nlevel, &full);
+  bp = dirblock(dp, lblk);
+  de = (struct dirent*)bp->data;
+  for(i = 0; i < DPB; i++)
+    if(de[i].inum == 0)
+      goto found;
+
+  // Split the leaf at the median hash, or the next larger
+  // one, so both halves keep a name.
+  if(dp->size/BSIZE + nlevel + 2 > MAXFILE || (full && nlevel == HTMAXDEPTH)){
+    brelse(bp);
+    return -1;
+  }
+  for(i = 0; i < DPB; i++){
+    t = dirhash(de[i].name);
+    for(j = i; j > 0 && hv[j-1] > t; j--)
+      hv[j] = hv[j-1];
+    hv[j] = t;
+  }
+  sep = hv[DPB/2];
+  for(i = 1; i < DPB && sep == hv[0]; i++)
+    sep = hv[i];
+  if(sep == hv[0]){
+    brelse(bp);
+    return -1;
+  }
+  nlblk = dirgrow(dp);
+  nbp = dirblock(dp, nlblk);
+  nde = (struct dirent*)nbp->data;
+  for(i = j = 0; i < DPB; i++){
+    if(dirhash(de[i].name) >= sep){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  log_write(bp);
+  log_write(nbp);
+  if(h >= sep){
+    brelse(bp);
+    bp = nbp;
+    de = nde;
+    lblk = nlblk;
+  } else
+    brelse(nbp);
+  for(i = 0; i < DPB; i++)
+    if(de[i].inum == 0)
+      break;
+  htaddidx(dp, path, pos, nlevel-1, sep, nlblk);
+
+found:
+  strncpy(de[i].name, name, DIRSIZ);
+  de[i].inum = inum;
+  log_write(bp);
+  brelse(bp);
+  htcount(dp, 1);
+  return lblk*BSIZE + i*sizeof(*de);
+}
+
+// Turn linear directory dp, whose blocks are all full, into
+// an indexed one: block 0 becomes the root and the names are
+// spread over the other blocks plus a new one, in hash order.
+static void
+htconvert(struct inode *dp)
+{
+  struct dirent *all, t;
+  uint *hv, max, nleaf, n, i, j, k, lblk, th;
+  struct buf *bp, *lbp;
+  struct htnode *root;
+
+  // Sort the names and their hashes in a page.
+  max = PGSIZE / (sizeof(*all) + sizeof(*hv));
+  if(dp->size/BSIZE*DPB > max || (all = (struct dirent*)kalloc()) == 0)
+    panic("htconvert");
+  hv = (uint*)(all + max);
+  n = 0;
+  for(lblk = 0; lblk < dp->size/BSIZE; lblk++){
+    bp = dirblock(dp, lblk);
+    for(i = 0; i < DPB; i++){
+      t = ((struct dirent*)bp->data)[i];
+      if(t.inum == 0)
+        continue;
+      // Insertion sort by hash.
+      th = dirhash(t.name);
+      for(j = n; j > 0 && hv[j-1] > th; j--){
+        all[j] = all[j-1];
+        hv[j] = hv[j-1];
+      }
+      all[j] = t;
+      hv[j] = th;
+      n++;
+    }
+    brelse(bp);
+  }
+
+  // Leaves are blocks 1..nleaf, each about half full.
+  nleaf = dp->size/BSIZE + 1;
+  while(dp->size/BSIZE <= nleaf)
+    dirgrow(dp);
+  bp = dirblock(dp, 0);
+  memset(bp->data, 0, BSIZE);
+  root = (struct htnode*)bp->data;
+  root->magic = HTMAGIC;
+  root->count = n;
+  for(i = 0, k = 1; k <= nleaf; k++){
+    j = i + (n - i) / (nleaf - k + 1);
+    if(k == nleaf)
+      j = n;
+    while(j > i && j < n && hv[j] == hv[j-1])
+      j++;
+    if(i < j || k == 1){
+      HTENTS(root)[root->n].hash = root->n == 0 ? 0 : hv[i];
+      HTENTS(root)[root->n].blk = k;
+      root->n++;
+    }
+    lbp = dirblock(dp, k);
+    memset(lbp->data, 0, BSIZE);
+    memmove(lbp->data, all+i, (j-i)*sizeof(*all));
+    log_write(lbp);
+    brelse(lbp);
+    i = j;
+  }
+  log_write(bp);
+  brelse(bp);
+  kfree((char*)all);
+  dp->flags |= I_HTREE;
+  iupdate(dp);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Consults the dentry cache first; a scan reads a
+// block of entries at a time.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, n, i;
+  struct dirent de[DPB];
+  struct dentry *d;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0){
+    inum = d->inum;
+    off = d->off;
+    release(&dcache.lock);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+  release(&dcache.lock);
+
+  if(dp->flags & I_HTREE){
+    if((inum = htlookup(dp, name, &off)) == 0){
+      dcacheset(dp, name, 0, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = off;
+    dcacheset(dp, name, inum, off);
+    return iget(dp->dev, inum);
+  }
+
+  for(off = 0; off < dp->size; off += n){
+    n = dp->size - off < sizeof(de) ? dp->size - off : sizeof(de);
+    if(readi(dp, (char*)de, off, n) != n)
       panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+    for(i = 0; i < n/sizeof(de[0]); i++){
+      if(de[i].inum == 0)
+        continue;
+      if(namecmp(name, de[i].name) == 0){
+        // entry matches path element
+        off += i*sizeof(de[0]);
+        if(poff)
+          *poff = off;
+        inum = de[i].inum;
+        dcacheset(dp, name, inum, off);
+        return iget(dp->dev, inum);
+      }
     }
   }
 
+  dcacheset(dp, name, 0, 0);
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// A linear directory that fills HTLINEAR blocks is indexed.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
@@ -621,6 +2735,13 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->flags & I_HTREE){
+    if((off = htinsert(dp, name, inum)) < 0)
+      return -1;
+    dcacheset(dp, name, inum, off);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -628,15 +2749,58 @@ dirlink(struct inode *dp, char *name, uint inum)
     if(de.inum == 0)
       break;
   }
+  if(off == dp->size && dp->size >= HTLINEAR*BSIZE){
+    htconvert(dp);
+    return dirlink(dp, name, inum);
+  }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheset(dp, name, inum, off);
 
   return 0;
 }
 
+// Remove the entry for name, at byte offset off, from dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    panic("unlink: writei");
+  if(dp->flags & I_HTREE)
+    htcount(dp, -1);
+  dcacheset(dp, name, 0, 0);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int
+isdirempty(struct inode *dp)
+{
+  int off;
+  struct dirent de;
+  struct buf *bp;
+  uint n;
+
+  if(dp->flags & I_HTREE){
+    bp = dirblock(dp, 0);
+    n = ((struct htnode*)bp->data)->count;
+    brelse(bp);
+    return n <= 2;
+  }
+  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+      panic("isdirempty: readi");
+    if(de.inum != 0)
+      return 0;
+  }
+  return 1;
+}
+
 //PAGEBREAK!
 // Paths
 
@@ -692,21 +2856,24 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    // Lookups only read the directory, so walks through
+    // the same directory can run side by side.
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
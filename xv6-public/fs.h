@@ -6,8 +6,8 @@
 #define BSIZE 512  // block size
 
 // Disk layout:
-// [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+// [ boot block | super block | orphan list | log | inode blocks |
+//                      inode bit map | free bit map | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -19,9 +19,11 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint imapstart;    // Block number of first inode map block
+  uint orphanblock;  // Block number of the orphan list
 };
 
-#define NDIRECT 11 // double indirect 추가 
+#define NDIRECT 10 // double indirect 추가, flags 추가
 #define NINDIRECT (BSIZE / sizeof(uint)) // indirect entry number
 #define NDOUBLEINDIRECT (NINDIRECT * NINDIRECT) // double indirect entry number
 #define MAXFILE (NDIRECT + NINDIRECT + NDOUBLEINDIRECT)
@@ -33,9 +35,56 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
+  uint flags;           // I_* flags
   uint addrs[NDIRECT+2];   // Data block addresses
 };
 
+// Inode flags
+#define I_EXTENT 0x1  // addrs[] holds an extent tree root, not block addresses
+#define I_HTREE  0x2  // directory indexed by name hash, see struct htnode
+
+// Extent-mapped inodes describe their content as runs of
+// contiguous disk blocks instead of one address per block.
+// The runs are kept in a small tree. Its root lives in place
+// of addrs[]; deeper nodes occupy whole disk blocks. Every
+// node starts with an exthdr. Leaves (depth 0) hold extents
+// sorted by lblk; interior nodes hold extidx entries, each
+// naming the block of a child whose extents start at or
+// after lblk. File blocks no extent covers are unallocated.
+struct exthdr {
+  ushort nent;   // Number of entries following the header
+  ushort depth;  // Height of this node above the leaves
+};
+
+struct extent {
+  uint lblk;     // First file block of the run
+  uint start;    // First disk block of the run
+  uint len;      // Number of blocks in the run, and EXT_UNWRITTEN
+};
+
+// An unwritten extent's blocks are allocated, by fallocate(),
+// but hold no data yet: they read as zeroes.
+#define EXT_UNWRITTEN 0x80000000
+#define EXTLEN(e) ((e)->len & ~EXT_UNWRITTEN)
+
+struct extidx {
+  uint lblk;     // Lowest file block mapped by the child
+  uint blk;      // Disk block holding the child node
+};
+
+#define EXTROOTSZ (sizeof(uint)*(NDIRECT+2))
+#define EXTMAXDEPTH 4
+
+// Entries per extent tree node of sz bytes
+#define NEXT(sz)    (((sz) - sizeof(struct exthdr)) / sizeof(struct extent))
+#define NEXTIDX(sz) (((sz) - sizeof(struct exthdr)) / sizeof(struct extidx))
+
+// The orphan list holds the numbers of inodes that have no
+// links but whose blocks are not all freed yet: files unlinked
+// while open, and large files being freed in the background.
+// A free slot is 0.
+#define NORPHAN       (BSIZE / sizeof(uint))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -48,11 +97,43 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) (b/BPB + sb.bmapstart)
 
+// Block of inode map containing bit for inode i
+#define IMBLOCK(i, sb) ((i)/BPB + sb.imapstart)
+
 // Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+#define DIRSIZ 30
 
 struct dirent {
   ushort inum;
   char name[DIRSIZ];
 };
 
+// Dirents per block
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// An indexed directory (I_HTREE) is a B-tree keyed by a hash
+// of the names. Its block 0 is the root index node; the other
+// blocks are index nodes or leaves. A leaf is an ordinary
+// block of dirents, in no order, holding the names whose hash
+// falls in the leaf's range. An index node lists its children
+// by the lowest hash each covers; the first entry's is 0.
+// Reading the directory as a file shows index nodes as unused
+// dirents, so programs that list directories need no change.
+struct htnode {
+  uint magic;     // HTMAGIC; its low half looks like inum 0
+  ushort depth;   // 0 if the children are leaves
+  ushort n;       // entries in use
+  uint count;     // in the root, names in the directory
+  uint pad;
+};
+
+struct htent {
+  uint hash;      // lowest name hash under the child
+  uint blk;       // child's block number within the directory
+};
+
+#define HTMAGIC     0x48540000
+#define NHTENT      ((BSIZE - sizeof(struct htnode)) / sizeof(struct htent))
+#define HTMAXDEPTH  3  // levels of index nodes
+#define HTLINEAR    2  // blocks a directory may have before it is indexed
+
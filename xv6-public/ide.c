@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code, with an elevator queue. Uses
+// bus-master DMA on a PIIX controller, else PIO.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +13,8 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -24,12 +27,67 @@
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+#define IDE_CMD_IDENTIFY 0xec
+#define IDE_CMD_SETMUL   0xc6
+#define IDE_DRQ       0x08
+
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// PIIX bus-master IDE registers, from BAR4, primary channel.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_START      0x01
+#define BM_READ       0x08  // device to memory
+#define BM_ERR        0x02
+#define BM_INTR       0x04
+
+// Physical region descriptor: one piece of a DMA transfer.
+// A piece may not cross a 64K boundary.
+struct prd {
+  uint addr;
+  ushort count;  // bytes
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last piece
+
+#define IDEMAXSECT    256   // sectors in one command; 0 in the count register
+
+#define IDEDEADLINE   50    // ticks a request may wait before it jumps the queue
+
+// ideactive points to the request now being read/written to the disk.
+// A request is a buf followed by the bufs of consecutive blocks
+// chained through vnext. idequeue lists the waiting requests through
+// qnext, sorted by device and block, and is served C-LOOK: the next
+// request at or after idedev/idepos, else the lowest. A request waiting
+// over IDEDEADLINE ticks goes first. A new request that continues or
+// precedes a waiting one of the same kind is merged into it.
 // You must hold idelock while manipulating queue.
+//
+// READ/WRITE MULTIPLE move idemult[drive] sectors per interrupt.
+// idesize[drive] is the drive's size in sectors; commands use
+// 28-bit addresses, so at most 2^28 sectors (128GB) are reachable.
+// idexfer and idexoff locate the next sector of the active
+// request, and ideleft counts the sectors it has still to move.
 
 static struct spinlock idelock;
+static struct buf *ideactive;
 static struct buf *idequeue;
+static uint idedev;      // where the disk arm is heading
+static uint idepos;
+static uint idestarted;  // ticks when ideactive started
+static struct buf *idexfer;
+static int idexoff;
+static int ideleft;
+static int idemult[2];
+static uint idesize[2];
+static struct iostat stat;
+
+// With DMA, idebm is the bus-master base port and prdt a page
+// of descriptors, enough for two per buf of a IDEMAXSECT request.
+static uint idebm;
+static struct prd *prdt;
 
 static int havedisk1;
 static void idestart(struct buf*);
@@ -47,9 +105,43 @@ idewait(int checkerr)
   return 0;
 }
 
+// Ask drive d for its size and largest READ/WRITE MULTIPLE
+// block, and switch it to that. Polls with interrupts masked.
+// Sets idesize[d] and idemult[d] (1 if unsupported).
+static void
+ideidentify(int d)
+{
+  ushort id[256];
+  int n, r;
+
+  idemult[d] = 1;
+  idesize[d] = 1 << 28;
+  outb(0x3f6, 0x02);  // nIEN
+  outb(0x1f6, 0xe0 | (d<<4));
+  idewait(0);
+  outb(0x1f7, IDE_CMD_IDENTIFY);
+  while(((r = inb(0x1f7)) & IDE_BSY) || !(r & (IDE_DRQ|IDE_ERR)))
+    ;
+  if(r & IDE_ERR)
+    return;
+  insl(0x1f0, id, sizeof(id)/4);
+  if(id[60] || id[61])
+    idesize[d] = id[60] | (id[61] << 16);  // LBA28 sectors
+  n = id[47] & 0xff;
+  if(n <= 1)
+    return;
+  idewait(0);
+  outb(0x1f2, n);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  if(idewait(1) < 0)
+    return;
+  idemult[d] = n;
+}
+
 void
 ideinit(void)
 {
+  struct pcidev pci;
   int i;
 
   initlock(&idelock, "ide");
@@ -65,67 +157,306 @@ ideinit(void)
     }
   }
 
+  ideidentify(0);
+  if(havedisk1)
+    ideidentify(1);
+
+  // Use bus-master DMA if the controller is a PIIX.
+  if((pcifind(0x8086, 0x7010, &pci) == 0 || pcifind(0x8086, 0x7111, &pci) == 0) &&
+     (pci.bar[4] & PCI_BAR_IO) && (prdt = (struct prd*)kalloc()) != 0){
+    idebm = pci.bar[4] & PCI_BAR_IOMASK;
+    pcimaster(&pci);
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+  outb(0x3f6, 0);
+}
+
+// Move the next n sectors of the active request between
+// the controller and its bufs. Caller must hold idelock.
+static void
+idepio(int write, int n)
+{
+  int spb = BSIZE/SECTOR_SIZE;
+
+  for(; n > 0; n--, ideleft--){
+    if(write)
+      outsl(0x1f0, idexfer->data + idexoff*SECTOR_SIZE, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, idexfer->data + idexoff*SECTOR_SIZE, SECTOR_SIZE/4);
+    if(++idexoff == spb){
+      idexfer = idexfer->vnext;
+      idexoff = 0;
+    }
+  }
+}
+
+// Describe request b's bufs in prdt, splitting any
+// that crosses a 64K boundary.
+static void
+ideprd(struct buf *b)
+{
+  struct prd *p;
+  uint pa, len, n;
+
+  p = prdt;
+  for(; b; b = b->vnext){
+    pa = V2P(b->data);
+    for(len = BSIZE; len > 0; len -= n, pa += n){
+      n = 0x10000 - (pa & 0xffff);
+      if(n > len)
+        n = len;
+      p->addr = pa;
+      p->count = n;
+      p->flags = 0;
+      p++;
+    }
+  }
+  p[-1].flags = PRD_EOT;
 }
 
 // Start the request for b.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  struct buf *c;
+  uint nblock, maxblock;
+  int mult;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+  nblock = 0;
+  for(c = b; c; c = c->vnext)
+    nblock++;
   int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  // Check in blocks, so the sector number cannot overflow.
+  maxblock = idesize[b->dev&1] / sector_per_block;
+  if(b->blockno >= maxblock || nblock > maxblock - b->blockno)
+    panic("incorrect blockno");
+  uint sector = b->blockno * sector_per_block;
+  int nsect = nblock * sector_per_block;
+
+  if (nsect > IDEMAXSECT) panic("idestart");
 
-  if (sector_per_block > 7) panic("idestart");
+  mult = idemult[b->dev&1];
+  int read_cmd = (mult == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
+  int write_cmd = (mult == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+
+  idexfer = b;
+  idexoff = 0;
+  ideleft = nsect;
+  idestarted = ticks;
+  idedev = b->dev;
+  idepos = b->blockno + nblock;
+  stat.reqs++;
+  stat.blocks += nblock;
+  stat.waitticks += ticks - b->qtime;
+
+  if(idebm){
+    // The controller moves the data and interrupts once.
+    ideprd(b);
+    ideleft = 0;
+    read_cmd = IDE_CMD_RDDMA;
+    write_cmd = IDE_CMD_WRDMA;
+    outl(idebm+BM_PRDT, V2P(prdt));
+    outb(idebm+BM_STATUS, inb(idebm+BM_STATUS) | BM_ERR | BM_INTR);
+    outb(idebm+BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ);
+  }
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsect & 0xff);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    if(!idebm)
+      idepio(1, ideleft < mult ? ideleft : mult);
   } else {
     outb(0x1f7, read_cmd);
   }
+  if(idebm)
+    outb(idebm+BM_CMD, inb(idebm+BM_CMD) | BM_START);
+}
+
+// Number of blocks in request b.
+static int
+idelen(struct buf *b)
+{
+  int n;
+
+  for(n = 0; b; b = b->vnext)
+    n++;
+  return n;
+}
+
+static struct buf*
+idelast(struct buf *b)
+{
+  while(b->vnext)
+    b = b->vnext;
+  return b;
+}
+
+// Does request a sort before b?
+static int
+idebefore(struct buf *a, struct buf *b)
+{
+  if(a->dev != b->dev)
+    return a->dev < b->dev;
+  return a->blockno < b->blockno;
+}
+
+// Can request b be appended to request a as one command?
+static int
+idejoins(struct buf *a, struct buf *b)
+{
+  return a->dev == b->dev && (a->flags & B_DIRTY) == (b->flags & B_DIRTY) &&
+    idelast(a)->blockno + 1 == b->blockno &&
+    (idelen(a) + idelen(b)) * (BSIZE/SECTOR_SIZE) <= IDEMAXSECT;
+}
+
+// Add request b to idequeue, in order, merging it with its
+// neighbours where it can.  Caller must hold idelock.
+static void
+idequeue_add(struct buf *b)
+{
+  struct buf **pp, *prev, *next;
+  int depth;
+
+  b->qtime = ticks;
+  depth = 0;
+  prev = 0;
+  for(pp=&idequeue; *pp && idebefore(*pp, b); pp=&(*pp)->qnext){  //DOC:insert-queue
+    prev = *pp;
+    depth++;
+  }
+  next = *pp;
+
+  if(prev){
+    if(idejoins(prev, b)){
+      idelast(prev)->vnext = b;
+      stat.merged++;
+      b = prev;
+      if(next && idejoins(b, next)){
+        idelast(b)->vnext = next;
+        b->qnext = next->qnext;
+        if(next->qtime < b->qtime)
+          b->qtime = next->qtime;
+        stat.merged++;
+      }
+      return;
+    }
+  }
+  if(next && idejoins(b, next)){
+    idelast(b)->vnext = next;
+    b->qnext = next->qnext;
+    b->qtime = next->qtime;
+    *pp = b;
+    stat.merged++;
+    return;
+  }
+  b->qnext = next;
+  *pp = b;
+
+  stat.arrivals++;
+  for(; next; next = next->qnext)
+    depth++;
+  depth++;
+  stat.depthsum += depth;
+  if(depth > stat.maxdepth)
+    stat.maxdepth = depth;
+}
+
+// Take the next request off idequeue.  Caller must hold idelock.
+static struct buf*
+idequeue_next(void)
+{
+  struct buf **pp, **oldest, **pick, *b;
+
+  if(idequeue == 0)
+    return 0;
+  oldest = pick = 0;
+  for(pp=&idequeue; *pp; pp=&(*pp)->qnext){
+    if(oldest == 0 || (*pp)->qtime < (*oldest)->qtime)
+      oldest = pp;
+    if(pick == 0 && ((*pp)->dev > idedev ||
+       ((*pp)->dev == idedev && (*pp)->blockno >= idepos)))
+      pick = pp;
+  }
+  if(ticks - (*oldest)->qtime >= IDEDEADLINE && oldest != pick){
+    pick = oldest;
+    stat.deadline++;
+  }
+  if(pick == 0)
+    pick = &idequeue;  // wrap around
+  b = *pick;
+  *pick = b->qnext;
+  b->qnext = 0;
+  return b;
 }
 
-// Interrupt handler.
+// Interrupt handler. Each interrupt ends one block of
+// sectors of the active request; when none are left,
+// the request is done.
 void
 ideintr(void)
 {
   struct buf *b;
+  int mult;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if((b = ideactive) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
+  mult = idemult[b->dev&1];
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    // The whole request is done, unless this interrupt
+    // is not from the DMA engine.
+    if((inb(idebm+BM_STATUS) & BM_INTR) == 0){
+      release(&idelock);
+      return;
+    }
+    outb(idebm+BM_CMD, 0);
+    outb(idebm+BM_STATUS, inb(idebm+BM_STATUS) | BM_ERR | BM_INTR);
+    idewait(1);
+  } else if(b->flags & B_DIRTY){
+    // Send the next block of sectors, if any.
+    if(ideleft > 0 && idewait(1) >= 0){
+      idepio(1, ideleft < mult ? ideleft : mult);
+      release(&idelock);
+      return;
+    }
+  } else {
+    // Read data if needed.
+    if(idewait(1) >= 0)
+      idepio(0, ideleft < mult ? ideleft : mult);
+    else
+      ideleft = 0;
+    if(ideleft > 0){
+      release(&idelock);
+      return;
+    }
+  }
+  stat.svcticks += ticks - idestarted;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Start disk on next request in queue.
+  ideactive = idequeue_next();
+  if(ideactive != 0)
+    idestart(ideactive);
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Wake processes waiting for the request's bufs.
+  for(; b; b = b->vnext){
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+  }
 
   release(&idelock);
 }
@@ -137,32 +468,68 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
+  iderwv(&b, 1);
+}
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+// Sync n bufs holding consecutive blocks of one device with
+// the disk, in as few commands as the controller allows.
+// All must be locked, and all written (B_DIRTY) or all read.
+void
+iderwv(struct buf **bv, int n)
+{
+  int i, j, k, write, max;
+
+  write = bv[0]->flags & B_DIRTY;
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bv[i]->lock))
+      panic("iderw: buf not locked");
+    if((bv[i]->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if((bv[i]->flags & B_DIRTY) != write || bv[i]->dev != bv[0]->dev ||
+       bv[i]->blockno != bv[0]->blockno + i)
+      panic("iderwv: not one run");
+  }
+  if(bv[0]->dev != 0 && !havedisk1){
+    // Disk 1 may be a virtio disk instead.
+    if(virtiorwv(bv, n) < 0)
+      panic("iderw: ide disk 1 not present");
+    return;
+  }
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  // Queue a request per IDEMAXSECT sectors.
+  max = IDEMAXSECT / (BSIZE/SECTOR_SIZE);
+  for(i = 0; i < n; i += k){
+    k = n - i < max ? n - i : max;
+    for(j = i; j < i+k; j++)
+      bv[j]->vnext = j+1 < i+k ? bv[j+1] : 0;
+
+    idequeue_add(bv[i]);
+  }
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(ideactive == 0){
+    ideactive = idequeue_next();
+    idestart(ideactive);
+  }
 
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Wait for requests to finish.
+  for(i = 0; i < n; i++){
+    while((bv[i]->flags & (B_VALID|B_DIRTY)) != B_VALID){
+      sleep(bv[i], &idelock);
+    }
   }
 
 
   release(&idelock);
 }
+
+// Copy the disk request statistics to st.
+void
+idestat(struct iostat *st)
+{
+  acquire(&idelock);
+  *st = stat;
+  release(&idelock);
+}
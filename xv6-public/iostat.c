@@ -0,0 +1,27 @@
+// Print the disk request queue statistics.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat st;
+
+  if(iostat(&st) < 0){
+    printf(2, "iostat: failed\n");
+    exit();
+  }
+  printf(1, "%d commands moved %d blocks\n", st.reqs, st.blocks);
+  printf(1, "%d requests queued, %d merged, %d served by deadline\n",
+         st.arrivals, st.merged, st.deadline);
+  if(st.arrivals > 0)
+    printf(1, "queue depth: avg %d max %d\n",
+           st.depthsum / st.arrivals, st.maxdepth);
+  if(st.reqs > 0)
+    printf(1, "ticks per command: wait %d service %d (total %d %d)\n",
+           st.waitticks / st.reqs, st.svcticks / st.reqs,
+           st.waitticks, st.svcticks);
+  exit();
+}
@@ -1,6 +1,10 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "stat.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -9,201 +13,723 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is closed only when there are
+// no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// A system call should call begin_op(n)/end_op() to mark
+// its start and end, where n is the most blocks it can log.
+// Usually begin_op() just reserves n blocks of the running
+// transaction and returns. But if the transaction cannot
+// hold them, it closes the transaction and sleeps until
+// the log thread has taken it over. end_op() returns the
+// unused part of the reservation. logstat() reports, per
+// system call, the blocks reserved and those really logged.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
-struct logheader {
+// Transactions are double-buffered. The log thread owns
+// the committing transaction: it snapshots the blocks into
+// shadow buffers and writes them to the log while new
+// system calls join the next running transaction. The
+// running transaction is closed when it is full, when it
+// has been open for LOGTIMEOUT ticks, or when log_wait()
+// asks for it, as fsync() does for the last transaction
+// that changed the file.
+//
+// The log is a circular physical re-do log containing disk
+// blocks. The on-disk log format:
+//   header block, containing the ring position and sequence
+//     number of the oldest record not yet checkpointed
+//   ring of records, each:
+//     descriptor blocks, containing a sequence number, block #s
+//       for block A, B, C, ... and a checksum of them and
+//       their contents
+//     block A
+//     block B
+//     block C
+//     ...
+// A record is one sequential run of writes and commits once
+// all of it is on disk. Recovery replays records from the
+// header's tail until it finds a stale sequence number or a
+// bad checksum, which marks a record torn by a crash.
+//
+// The ring size comes from the superblock, and a quarter
+// of it, up to LOGSIZE blocks, bounds one transaction.
+//
+// Committed blocks stay in the log, and pinned in the
+// buffer cache, until the log thread needs their space, or
+// until the log has been idle for CKPTDELAY ticks. It then
+// checkpoints the oldest records, writing their blocks home,
+// and moves the tail in the header past them.
+//
+// With LOGORDERED, file content is not journaled. iflush()
+// hands data blocks to log_writedatav(), which writes them in
+// place at once, so they reach the disk before the commit
+// of the transaction that allocates them or grows the file.
+// A block freed by an uncommitted transaction may still be
+// reachable from the on-disk metadata, perhaps as an
+// indirect block, and recovery would write a block still in
+// the log over the data; data reusing such a block is
+// journaled like metadata.
+
+#define LOGMAGIC 0x4c4f4752  // "LOGR"
+#define LOGDESCN ((BSIZE - 4*sizeof(uint)) / sizeof(uint))
+#define LOGCONTN (BSIZE / sizeof(uint))
+#define LOGMAXDESC (2 + LOGSIZE/LOGCONTN)  // descriptors of a record
+
+// Contents of the header block.
+struct loghead {
+  uint tail;   // ring position of the oldest record
+  uint seq;    // its sequence number
+};
+
+// First descriptor block of each record. Continuation
+// descriptor blocks hold LOGCONTN more block #s each.
+struct logdesc {
+  uint magic;
+  uint seq;
+  uint n;
+  uint sum;    // checksum of the block #s and the blocks
+  uint block[LOGDESCN];
+};
+
+// One transaction: the blocks it logged and the block
+// runs it freed.
+struct trans {
   int n;
-  int block[LOGSIZE];
+  uint block[LOGSIZE];
+  struct buf *buf[LOGSIZE];  // pinned cache buffers
+  int nfreed;      // block runs freed by this transaction
+  int freedfull;   // more runs were freed than freed[] holds
+  struct {
+    uint start;
+    uint n;
+  } freed[NFREED];
 };
 
+// The log thread sleeps on &log.cur.
+//
+// Records from log.tail up to log.head are committed but not
+// checkpointed. ring[] mirrors them: the number of logged blocks
+// at each record's first descriptor and the home block # of each
+// logged block, whose pinned cache buffer is in ringbuf[].
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the ring
+  int max;         // most blocks in one transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they may still add to cur
+  int closing;     // running transaction admits no new ops.
+  int committing;  // log thread is writing log.com.
   int dev;
-  struct logheader lh;
+  uint tid;        // id of the running transaction
+  uint done;       // transactions up to this id have committed
+  uint forced;     // close transactions up to this id now
+  uint opened;     // ticks when the running transaction began logging
+  uint committed;  // ticks when the last record committed
+  struct trans cur;  // running transaction
+  struct trans com;  // committing transaction
+  struct buf shadow[LOGSIZE];  // copies of com's blocks
+  struct buf desc[LOGMAXDESC];  // com's descriptors
+  struct buf io;   // checkpoint copies
+  struct buf *vec[LOGMAXDESC+LOGSIZE];  // a record's bufs, in order
+  uint head;       // ring position of the next record
+  uint seq;        // its sequence number
+  uint tail;
+  uint tailseq;
+  int used;        // ring blocks from tail to head
+  uint ring[LOGBLOCKS];
+  struct buf *ringbuf[LOGBLOCKS];
+  struct logstat stat[NLOGSTAT];
+  struct logtotal total;
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logthread(void);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  int i;
 
   struct superblock sb;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  log.size = sb.nlog - 1;
+  if (log.size > LOGBLOCKS)
+    log.size = LOGBLOCKS;  // use what ring[] can track
+  log.max = log.size / 4;
+  if (log.max > LOGSIZE)
+    log.max = LOGSIZE;
+  if (log.max < MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
+  for(i = 0; i < LOGSIZE; i++)
+    initsleeplock(&log.shadow[i].lock, "shadow");
+  for(i = 0; i < LOGMAXDESC; i++)
+    initsleeplock(&log.desc[i].lock, "logdesc");
+  initsleeplock(&log.io.lock, "logio");
   recover_from_log();
+  log.tid = 1;
+  kproc("logd", logthread);
+}
+
+// Disk block of ring position pos.
+static uint
+logblock(uint pos)
+{
+  return log.start + 1 + pos % log.size;
+}
+
+// Descriptor blocks of a record of n blocks.
+static uint
+ndesc(uint n)
+{
+  if (n <= LOGDESCN)
+    return 1;
+  return 1 + (n - LOGDESCN + LOGCONTN - 1) / LOGCONTN;
+}
+
+static uint
+cksum(uint sum, uchar *data)
+{
+  uint *p = (uint*)data;
+  int i;
+
+  for (i = 0; i < BSIZE/sizeof(uint); i++)
+    sum = sum*33 + p[i];
+  return sum;
 }
 
-// Copy committed blocks from log to their home location
+// Read or write private buffer b as disk block blockno.
+// The buffer cache is bypassed: it keeps the newer copy.
 static void
-install_trans(void)
+rawio(struct buf *b, uint blockno, int write)
 {
-  int tail;
+  acquiresleep(&b->lock);
+  b->dev = log.dev;
+  b->blockno = blockno;
+  b->flags = write ? B_VALID | B_DIRTY : 0;
+  iderw(b);
+  releasesleep(&b->lock);
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+// Read or write the n private bufs bv as the ring blocks
+// from position pos on, with one vectored request for each
+// side of the wrap.
+static void
+rawiov(struct buf **bv, uint pos, int n, int write)
+{
+  int i, k;
+
+  for (i = 0; i < n; i++) {
+    acquiresleep(&bv[i]->lock);
+    bv[i]->dev = log.dev;
+    bv[i]->blockno = logblock(pos+i);
+    bv[i]->flags = write ? B_VALID | B_DIRTY : 0;
+  }
+  for (i = 0; i < n; i += k) {
+    k = log.size - (pos+i) % log.size;  // blocks before the wrap
+    if (k > n - i)
+      k = n - i;
+    iderwv(bv+i, k);
+  }
+  for (i = 0; i < n; i++)
+    releasesleep(&bv[i]->lock);
+}
+
+// Return in bv the n ring blocks from position pos on,
+// read through the buffer cache.
+static void
+readring(uint pos, int n, struct buf **bv)
+{
+  int i, k;
+
+  for (i = 0; i < n; i += k) {
+    k = log.size - (pos+i) % log.size;
+    if (k > n - i)
+      k = n - i;
+    breadv(log.dev, logblock(pos+i), k, bv+i);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+  struct loghead *lh = (struct loghead *) (buf->data);
+  log.tail = lh->tail % log.size;
+  log.tailseq = lh->seq;
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write a new tail to the log header on disk. Recovery
+// no longer replays the records behind it, so their
+// space may be reused.
 static void
-write_head(void)
+write_head(uint tail, uint seq)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  struct loghead *hb = (struct loghead *) (buf->data);
+  hb->tail = tail;
+  hb->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
 
+// If the record at pos with sequence number seq committed,
+// copy its blocks to their home locations and return its
+// length in the ring; else return 0. Gathers the block #s
+// and home bufs in log.com, which is unused until the log
+// thread starts.
+static int
+replay(uint pos, uint seq)
+{
+  struct buf *dbuf, **lv, **hv;
+  struct logdesc *d;
+  uint i, j, k, n, nd, sum;
+  uint *block = log.com.block;
+
+  dbuf = bread(log.dev, logblock(pos));
+  d = (struct logdesc *) (dbuf->data);
+  n = d->n;
+  nd = ndesc(n);
+  if (d->magic != LOGMAGIC || d->seq != seq ||
+      n == 0 || n > LOGSIZE || nd + n >= log.size) {
+    brelse(dbuf);
+    return 0;
+  }
+
+  // Read the rest of the record in one go.
+  lv = log.vec;
+  readring(pos+1, nd-1+n, lv);
+  sum = 0;
+  for (i = 0; i < n; i++) {
+    if (i < LOGDESCN)
+      block[i] = d->block[i];
+    else
+      block[i] = ((uint *) (lv[(i-LOGDESCN)/LOGCONTN]->data))[(i-LOGDESCN)%LOGCONTN];
+    sum = sum*33 + block[i];
+  }
+  lv += nd-1;
+  for (i = 0; i < n; i++)
+    sum = cksum(sum, lv[i]->data);
+
+  if (sum == d->sum) {  // else torn by a crash
+    // Copy to dst, writing each run of consecutive
+    // home blocks with one request.
+    hv = log.com.buf;
+    for (i = 0; i < n; i = j) {
+      for (j = i+1; j < n && block[j] == block[j-1] + 1; j++)
+        ;
+      for (k = i; k < j; k++) {
+        hv[k] = bnew(log.dev, block[k]);
+        memmove(hv[k]->data, lv[k]->data, BSIZE);
+      }
+      bwritev(hv+i, j-i);
+      for (k = i; k < j; k++)
+        brelse(hv[k]);
+    }
+  }
+  for (i = 0; i < nd-1+n; i++)
+    brelse(log.vec[i]);
+  brelse(dbuf);
+  return sum == d->sum ? nd + n : 0;
+}
+
 static void
 recover_from_log(void)
 {
+  int len;
+
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  while ((len = replay(log.tail, log.tailseq)) > 0) {
+    log.tail = (log.tail + len) % log.size;
+    log.tailseq++;
+  }
+  write_head(log.tail, log.tailseq); // the replayed records are home
+  log.head = log.tail;
+  log.seq = log.tailseq;
+  log.used = 0;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call, which
+// may log up to n blocks.
 void
-begin_op(void)
+begin_op(int n)
 {
+  struct proc *p = myproc();
+
+  if(n > log.max)
+    panic("begin_op: too big a reservation");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.cur.n + log.reserved + n > log.max){
+      // this op might exhaust log space; close the
+      // transaction and wait for the log thread.
+      log.closing = 1;
+      wakeup(&log.cur);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      p->logres = n;
+      p->logused = 0;
       release(&log.lock);
       break;
     }
   }
 }
 
+// Account the op that myproc() is ending to its
+// system call's logstat slot.
+static void
+opstat(struct proc *p)
+{
+  struct logstat *st;
+  uint num;
+
+  num = p->tf->eax;
+  if(num >= NLOGSTAT)
+    num = 0;
+  st = &log.stat[num];
+  st->ops++;
+  st->reserved += p->logres;
+  st->logged += p->logused;
+  if(p->logused > st->maxlogged)
+    st->maxlogged = p->logused;
+  if(p->logused > p->logres)
+    st->over++;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets the log thread take over a closed transaction
+// if this was its last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  if(p->logused < p->logres)
+    log.reserved -= p->logres - p->logused;
+  opstat(p);
+  if(log.outstanding == 0 && log.closing)
+    wakeup(&log.cur);
+  // begin_op() may be waiting for log space,
+  // and returning the unused reservation has
+  // made room.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Copy the log usage of the first n <= NLOGSTAT kinds of
+// system call, indexed by syscall number, to st, and the
+// log's totals to t unless it is 0. Slot 0 collects kernel
+// threads. Returns the number of slots copied.
+int
+logstat(struct logstat *st, int n, struct logtotal *t)
+{
+  acquire(&log.lock);
+  memmove(st, log.stat, n*sizeof(*st));
+  if(t)
+    *t = log.total;
+  release(&log.lock);
+  return n;
+}
+
+// Most blocks one FS op may reserve.
+int
+log_opmax(void)
+{
+  return log.max;
+}
+
+// Id of the running transaction, which the caller's
+// updates join if it is in one.
+uint
+log_tid(void)
+{
+  uint t;
+
+  acquire(&log.lock);
+  t = log.tid;
+  release(&log.lock);
+  return t;
+}
+
+// Wait until transaction t, and every one before it, has
+// committed, closing it now if it is still running. Must
+// not be called inside a transaction.
+void
+log_wait(uint t)
+{
+  acquire(&log.lock);
+  if(t >= log.tid){
+    t = log.tid;
+    if(log.cur.n == 0)
+      t--;  // only the committing transaction, if any
   }
+  if(log.forced < t)
+    log.forced = t;
+  wakeup(&log.cur);
+  while(log.done < t)
+    sleep(&log, &log.lock);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Wait until the updates of every FS system call that
+// has finished are on disk. Must not be called inside
+// a transaction.
+void
+log_force(void)
+{
+  log_wait(~0);
+}
+
+// Called on each timer tick: wake the log thread once the
+// running transaction has been open for LOGTIMEOUT ticks, or
+// once committed records have waited CKPTDELAY ticks with
+// nothing else to do. Reads log without the lock; a stale
+// view only delays the work to a later tick.
+void
+log_tick(uint now)
+{
+  if(log.cur.n > 0 && now - log.opened >= LOGTIMEOUT)
+    wakeup(&log.cur);
+  if(log.used > 0 && log.cur.n == 0 && now - log.committed >= CKPTDELAY)
+    wakeup(&log.cur);
+}
+
+static int
+inlog(struct trans *t, uint blockno)
+{
+  int i;
+
+  for (i = 0; i < t->n; i++) {
+    if (t->block[i] == blockno)
+      return 1;
   }
+  return 0;
 }
 
-// Copy modified blocks from cache to log.
+// Does a record from ring position pos up to the head
+// log blockno?
+static int
+inring(uint pos, uint blockno)
+{
+  uint i, n, nd;
+
+  for (; pos != log.head; pos = (pos + nd + n) % log.size) {
+    n = log.ring[pos];
+    nd = ndesc(n);
+    for (i = nd; i < nd + n; i++) {
+      if (log.ring[(pos + i) % log.size] == blockno)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Checkpoint the record at ring position pos: write home
+// each of its blocks that no later record logs again, and
+// drop its pins. Returns the record's length in the ring.
+static int
+checkpoint(uint pos)
+{
+  uint i, p, n, nd, next;
+
+  n = log.ring[pos];
+  nd = ndesc(n);
+  next = (pos + nd + n) % log.size;
+  for (i = nd; i < nd + n; i++) {
+    p = (pos + i) % log.size;
+    if (!inring(next, log.ring[p])) {
+      rawio(&log.io, logblock(p), 0);
+      rawio(&log.io, log.ring[p], 1);
+    }
+    bunpin(log.ringbuf[p]);
+  }
+  return nd + n;
+}
+
+// Make room at the head for a record of len blocks by
+// checkpointing the oldest records. One block always stays
+// free, so head == tail only when the ring is empty.
 static void
-write_log(void)
+makeroom(int len)
+{
+  uint tail, seq;
+  int used, n;
+
+  tail = log.tail;
+  seq = log.tailseq;
+  used = log.used;
+  if (log.size - 1 - used >= len)
+    return;
+  while (log.size - 1 - used < len) {
+    n = checkpoint(tail);
+    tail = (tail + n) % log.size;
+    seq++;
+    used -= n;
+    log.total.ckpts++;
+  }
+  write_head(tail, seq);
+
+  // Only now may log_writedatav() write the checkpointed
+  // blocks in place.
+  acquire(&log.lock);
+  log.tail = tail;
+  log.tailseq = seq;
+  log.used = used;
+  release(&log.lock);
+}
+
+// Copy the committing transaction's blocks from the cache.
+// No system call is active, so nothing is changing them.
+static void
+snapshot(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (tail = 0; tail < log.com.n; tail++) {
+    struct buf *from = bread(log.dev, log.com.block[tail]);
+    memmove(log.shadow[tail].data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Append the committing transaction to the ring as one
+// record. It commits when the last block is on disk.
 static void
-commit()
+commit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  struct logdesc *d;
+  uint *cont;
+  uint pos, p, sum, n, nd, i, k;
+
+  n = log.com.n;
+  nd = ndesc(n);
+  makeroom(nd + n);
+  pos = log.head;
+
+  sum = 0;
+  for (i = 0; i < n; i++)
+    sum = sum*33 + log.com.block[i];
+  for (i = 0; i < n; i++)
+    sum = cksum(sum, log.shadow[i].data);
+  d = (struct logdesc *) (log.desc[0].data);
+  memset(d, 0, BSIZE);
+  d->magic = LOGMAGIC;
+  d->seq = log.seq;
+  d->n = n;
+  d->sum = sum;
+  for (i = 0; i < n && i < LOGDESCN; i++)
+    d->block[i] = log.com.block[i];
+  for (k = 1; k < nd; k++) {
+    cont = (uint *) (log.desc[k].data);
+    memset(cont, 0, BSIZE);
+    for (i = 0; i < LOGCONTN && LOGDESCN+(k-1)*LOGCONTN+i < n; i++)
+      cont[i] = log.com.block[LOGDESCN+(k-1)*LOGCONTN+i];
+  }
+
+  // The whole record in one vectored write, two if it wraps.
+  for (k = 0; k < nd; k++)
+    log.vec[k] = &log.desc[k];
+  for (i = 0; i < n; i++)
+    log.vec[nd+i] = &log.shadow[i];
+  rawiov(log.vec, pos, nd + n, 1);
+
+  acquire(&log.lock);
+  log.ring[pos] = n;
+  for (i = 0; i < n; i++) {
+    p = (pos + nd + i) % log.size;
+    log.ring[p] = log.com.block[i];
+    log.ringbuf[p] = log.com.buf[i];
+  }
+  log.head = (pos + nd + n) % log.size;
+  log.seq++;
+  log.used += nd + n;
+  log.committed = ticks;
+  log.total.commits++;
+  log.total.blocks += n;
+  release(&log.lock);
+}
+
+// The log thread. Waits for the running transaction to be
+// closed and drained, makes it the committing transaction,
+// reopens the log to new system calls and commits.
+static void
+logthread(void)
+{
+  uint tid;
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.cur.n > 0 && !log.closing && log.forced >= log.tid){
+      log.closing = 1;
+      log.total.forced++;
+    }
+    if(log.cur.n > 0 && ticks - log.opened >= LOGTIMEOUT)
+      log.closing = 1;
+    if(!log.closing && log.cur.n == 0 && log.used > 0 &&
+       ticks - log.committed >= CKPTDELAY){
+      // Idle: write the committed blocks home in the
+      // background, so that they don't wait for a commit
+      // to need the ring, and recovery has less to replay.
+      // One record at a time, to notice new work.
+      release(&log.lock);
+      makeroom(log.size - log.used);
+      acquire(&log.lock);
+      continue;
+    }
+    if(!log.closing || log.outstanding > 0){
+      sleep(&log.cur, &log.lock);
+      continue;
+    }
+    if(log.cur.n == 0){
+      log.closing = 0;
+      wakeup(&log);
+      continue;
+    }
+
+    log.com = log.cur;
+    log.cur.n = 0;
+    log.cur.nfreed = 0;
+    log.cur.freedfull = 0;
+    log.committing = 1;
+    tid = log.tid++;
+    release(&log.lock);
+
+    snapshot();
+
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit();
+
+    acquire(&log.lock);
+    log.com.n = 0;
+    log.com.nfreed = 0;
+    log.com.freedfull = 0;
+    log.committing = 0;
+    log.done = tid;
+    wakeup(&log);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// Record the block number and pin it in the cache.
+// The log thread will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -213,22 +739,109 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.cur.n >= log.max)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < log.cur.n; i++) {
+    if (log.cur.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+  if (i == log.cur.n) {
+    if (i == 0)
+      log.opened = ticks;
+    p = myproc();
+    if (p->logused++ < p->logres)
+      log.reserved--;
+    log.cur.block[i] = b->blockno;
+    log.cur.buf[i] = b;
+    log.cur.n++;
+    bpin(b);  // until checkpointed
+  }
+  release(&log.lock);
+}
+
+
+// Note that the running transaction freed disk blocks
+// [b, b+n). Until it commits they must not be overwritten
+// in place.
+void
+log_bfree(uint b, uint n)
+{
+  struct trans *t = &log.cur;
+
+  acquire(&log.lock);
+  if(t->nfreed > 0 && t->freed[t->nfreed-1].start + t->freed[t->nfreed-1].n == b)
+    t->freed[t->nfreed-1].n += n;
+  else if(t->nfreed < NFREED){
+    t->freed[t->nfreed].start = b;
+    t->freed[t->nfreed].n = n;
+    t->nfreed++;
+  } else
+    t->freedfull = 1;
   release(&log.lock);
 }
 
+// May block b be written in place while transaction t
+// is uncommitted?
+static int
+safeinplace(struct trans *t, uint b)
+{
+  int i;
+
+  if(t->freedfull)
+    return 0;
+  for (i = 0; i < t->nfreed; i++) {
+    if (b - t->freed[i].start < t->freed[i].n)
+      return 0;
+  }
+  return !inlog(t, b);  // else already journaled
+}
+
+// May file content block b be written in place now?
+// Caller holds log.lock.
+static int
+inplaceok(uint b)
+{
+  if(!LOGORDERED || !safeinplace(&log.cur, b))
+    return 0;
+  if(log.committing && !safeinplace(&log.com, b))
+    return 0;
+  return !inring(log.tail, b);
+}
+
+// Caller has modified the n bufs bv, blocks of file content
+// with consecutive block numbers. Write them in place if
+// ordered mode allows, each run of such blocks with one
+// request, and log the others; used in place of log_write().
+// Returns how many were logged.
+int
+log_writedatav(struct buf **bv, int n)
+{
+  int i, j, ok, logged;
+
+  if (log.outstanding < 1)
+    panic("log_writedatav outside of trans");
+
+  logged = 0;
+  for (i = 0; i < n; i = j) {
+    acquire(&log.lock);
+    ok = inplaceok(bv[i]->blockno);
+    for (j = i+1; ok && j < n && inplaceok(bv[j]->blockno); j++)
+      ;
+    release(&log.lock);
+    if (ok)
+      bwritev(bv+i, j-i);
+    else {
+      log_write(bv[i]);
+      logged++;
+      j = i+1;
+    }
+  }
+  return logged;
+}
@@ -0,0 +1,62 @@
+// Print the log's totals and, per system call, how many log
+// blocks FS ops reserved in begin_op() and how many they
+// really logged.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "syscall.h"
+
+char *names[NLOGSTAT] = {
+[0]            "kernel",
+[SYS_fork]     "fork",
+[SYS_exit]     "exit",
+[SYS_wait]     "wait",
+[SYS_pipe]     "pipe",
+[SYS_read]     "read",
+[SYS_kill]     "kill",
+[SYS_exec]     "exec",
+[SYS_fstat]    "fstat",
+[SYS_chdir]    "chdir",
+[SYS_dup]      "dup",
+[SYS_getpid]   "getpid",
+[SYS_sbrk]     "sbrk",
+[SYS_sleep]    "sleep",
+[SYS_uptime]   "uptime",
+[SYS_open]     "open",
+[SYS_write]    "write",
+[SYS_mknod]    "mknod",
+[SYS_unlink]   "unlink",
+[SYS_link]     "link",
+[SYS_mkdir]    "mkdir",
+[SYS_close]    "close",
+[SYS_fsync]    "fsync",
+};
+
+struct logstat st[NLOGSTAT];
+struct logtotal t;
+
+int
+main(int argc, char *argv[])
+{
+  int i, n;
+
+  if((n = logstat(st, NLOGSTAT, &t)) < 0){
+    printf(2, "logstat: failed\n");
+    exit();
+  }
+  printf(1, "%d commits of %d blocks, %d forced, %d checkpointed\n",
+         t.commits, t.blocks, t.forced, t.ckpts);
+  printf(1, "syscall\tops\treserved\tlogged\tmax\tover\n");
+  for(i = 0; i < n; i++){
+    if(st[i].ops == 0)
+      continue;
+    if(names[i])
+      printf(1, "%s", names[i]);
+    else
+      printf(1, "%d", i);
+    printf(1, "\t%d\t%d\t%d\t%d\t%d\n", st[i].ops, st[i].reserved,
+           st[i].logged, st[i].maxlogged, st[i].over);
+  }
+  exit();
+}
@@ -12,6 +12,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
@@ -58,3 +59,18 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+void
+idestat(struct iostat *st)
+{
+  memset(st, 0, sizeof(*st));
+}
+
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bv[i]);
+}
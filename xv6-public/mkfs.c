@@ -15,31 +15,40 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+// One inode per BLOCKSPERINODE blocks, at least MININODES and
+// no more than a dirent's ushort inum can name.
+#define BLOCKSPERINODE 100
+#define MININODES 200
+#define MAXINODES 65535
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+// [ boot block | sb block | log | inode blocks | inode bit map | free bit map | data blocks ]
+
+uint fssize = FSSIZE;
+uint ninodes;
+int nbitmap;
+int ninodeblocks;
+int nimap;
+int nlog = LOGBLOCKS+1;  // header and ring
+int nmeta;    // Number of meta blocks (boot, sb, orphans, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
 
 void balloc(int);
+void imalloc(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void htbuild(uint inum, struct dirent *de, int n);
+uint extappend(struct dinode *din, uint fbn);
 
 // convert to intel byte order
 ushort
@@ -69,17 +78,42 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
+  char *end;
+  struct dirent de, *rootde;
+  int nroot;
   char buf[BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-s") == 0){
+    fssize = strtoul(argv[2], &end, 0);
+    if(*end != 0 || fssize == 0){
+      fprintf(stderr, "mkfs: bad size %s\n", argv[2]);
+      exit(1);
+    }
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-s blocks] fs.img files...\n");
     exit(1);
   }
+  if((fssize + BPB - 1) / BPB > NBGROUP){
+    fprintf(stderr, "mkfs: %u blocks is more than the kernel's %d groups\n",
+            fssize, NBGROUP);
+    exit(1);
+  }
+
+  ninodes = fssize / BLOCKSPERINODE;
+  if(ninodes < MININODES)
+    ninodes = MININODES;
+  if(ninodes > MAXINODES)
+    ninodes = MAXINODES;
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
+  nimap = ninodes/(BSIZE*8) + 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
@@ -91,24 +125,34 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nmeta = 3 + nlog + ninodeblocks + nimap + nbitmap;
+  if(nmeta >= fssize){
+    fprintf(stderr, "mkfs: %u blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.orphanblock = xint(2);
+  sb.logstart = xint(3);
+  sb.inodestart = xint(3+nlog);
+  sb.imapstart = xint(3+nlog+ninodeblocks);
+  sb.bmapstart = xint(3+nlog+ninodeblocks+nimap);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, orphans, log blocks %u inode blocks %u, inode bitmap blocks %u, bitmap blocks %u) blocks %d total %u\n",
+         nmeta, nlog, ninodeblocks, nimap, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // An empty image of the full size; blocks not written
+  // below read as zeroes, and take no space on the host.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -116,16 +160,18 @@ main(int argc, char *argv[])
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
+  rootde = calloc(argc, sizeof(*rootde));
+  nroot = 0;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootde[nroot++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootde[nroot++] = de;
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -147,7 +193,7 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootde[nroot++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -155,14 +201,21 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(nroot > HTLINEAR*DPB)
+    htbuild(rootino, rootde, nroot);
+  else {
+    iappend(rootino, rootde, nroot*sizeof(*rootde));
+
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
+  imalloc(freeinode);
 
   exit(0);
 }
@@ -170,7 +223,7 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -210,7 +263,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -230,6 +283,8 @@ ialloc(ushort type)
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(type == T_FILE)
+    din.flags = xint(I_EXTENT);
   winode(inum, &din);
   return inum;
 }
@@ -238,16 +293,34 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
+  for(b = 0; b*BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b*BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b);
+    wsect(sb.bmapstart + b, buf);
+  }
+}
+
+// Mark inodes [0, used) allocated in the inode bitmap.
+// Inode 0 is never handed out.
+void
+imalloc(int used)
+{
+  uchar buf[BSIZE];
+  int i;
+
+  printf("imalloc: first %d inodes have been allocated\n", used);
   assert(used < BSIZE*8);
   bzero(buf, BSIZE);
   for(i = 0; i < used; i++){
     buf[i/8] = buf[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  wsect(sb.imapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -267,8 +340,10 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    assert((xint(din.flags) & I_EXTENT) || fbn < MAXFILE);
+    if(xint(din.flags) & I_EXTENT){
+      x = extappend(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
@@ -295,3 +370,94 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Return the disk block for file block fbn of extent-mapped
+// inode din, allocating it if need be. Files are written one
+// after another from freeblock, so each is normally a single
+// extent; the in-inode root is all mkfs needs.
+uint
+extappend(struct dinode *din, uint fbn)
+{
+  struct exthdr *h = (struct exthdr*)din->addrs;
+  struct extent *e = (struct extent*)(h+1);
+  uint n = xshort(h->nent);
+
+  if(n > 0 && fbn < xint(e[n-1].lblk) + xint(e[n-1].len))
+    return xint(e[n-1].start) + fbn - xint(e[n-1].lblk);
+  if(n > 0 && xint(e[n-1].start) + xint(e[n-1].len) == freeblock){
+    e[n-1].len = xint(xint(e[n-1].len) + 1);
+  } else {
+    assert(n < NEXT(EXTROOTSZ));
+    e[n].lblk = xint(fbn);
+    e[n].start = xint(freeblock);
+    e[n].len = xint(1);
+    h->nent = xshort(n + 1);
+  }
+  return freeblock++;
+}
+
+// Hash of a directory entry name; must match dirhash() in fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+int
+hashcmp(const void *a, const void *b)
+{
+  uint ha = dirhash(((struct dirent*)a)->name);
+  uint hb = dirhash(((struct dirent*)b)->name);
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Write the n entries de of empty directory inum as an
+// indexed directory: a root index node, then leaves about
+// 3/4 full in hash order. See struct htnode in fs.h.
+void
+htbuild(uint inum, struct dirent *de, int n)
+{
+  char root[BSIZE], leaf[BSIZE];
+  struct htnode *x = (struct htnode*)root;
+  struct htent *e = (struct htent*)(x+1);
+  struct dirent *(start[NHTENT+1]);
+  struct dinode din;
+  int i, j, k;
+
+  qsort(de, n, sizeof(*de), hashcmp);
+
+  // Choose the leaves; names with equal hashes share one.
+  bzero(root, sizeof(root));
+  for(i = k = 0; i < n; i = j, k++){
+    assert(k < NHTENT);
+    j = min(i + DPB*3/4, n);
+    while(j < n && dirhash(de[j].name) == dirhash(de[j-1].name))
+      j++;
+    assert(j - i <= DPB);
+    start[k] = de + i;
+    e[k].hash = xint(k == 0 ? 0 : dirhash(de[i].name));
+    e[k].blk = xint(k + 1);
+  }
+  start[k] = de + n;
+  x->magic = xint(HTMAGIC);
+  x->depth = xshort(0);
+  x->n = xshort(k);
+  x->count = xint(n);
+  iappend(inum, root, BSIZE);
+  for(i = 0; i < k; i++){
+    bzero(leaf, sizeof(leaf));
+    memmove(leaf, start[i], (start[i+1] - start[i]) * sizeof(*de));
+    iappend(inum, leaf, BSIZE);
+  }
+
+  rinode(inum, &din);
+  din.flags = xint(xint(din.flags) | I_HTREE);
+  winode(inum, &din);
+}
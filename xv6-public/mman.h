@@ -0,0 +1,9 @@
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+
+#define MAP_SHARED    0x01  // stores reach the file
+#define MAP_PRIVATE   0x02  // stores are private copies
+#define MAP_ANONYMOUS 0x20  // zeroed memory, no file
+
+#define MAP_FAILED ((void*)-1)
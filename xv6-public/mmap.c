@@ -0,0 +1,358 @@
+// Memory mappings.
+//
+// mmap() reserves a range of the address space above MMAPBASE,
+// beyond the reach of sbrk(), and records it in one of the
+// process's struct vmas. No memory is mapped until the process
+// touches a page: trap() calls mmapfault(), which maps
+//
+// * for an anonymous mapping, a new zeroed page;
+// * for a MAP_SHARED file mapping, the file's page in the page
+//   cache itself, pinned there until it is unmapped, so every
+//   process mapping the file, and read() and write(), see the
+//   same memory;
+// * for a MAP_PRIVATE file mapping, the page cache's page too,
+//   but read-only; the first store to it makes a private copy.
+//
+// Whether a present PTE of a file mapping refers to the page
+// cache or to a private copy is told by PTE_W: a private
+// mapping only maps its copies writable, and a shared one maps
+// nothing else. When a shared page is unmapped, at munmap(),
+// exit() or exec(), the PTE's dirty bit, set by the hardware on
+// a store, marks the cache page dirty, and writeback takes it
+// from there.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "stat.h"
+#include "page.h"
+#include "mman.h"
+
+// Return p's mapping containing va, or 0.
+static struct vma*
+vmafind(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start && v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Return the lowest address above MMAPBASE with n free bytes
+// of address space, or 0 if there is none.
+static uint
+vmaplace(struct proc *p, uint n)
+{
+  struct vma *v;
+  uint a;
+
+  a = MMAPBASE;
+again:
+  if(a + n > KERNBASE || a + n < a)
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start && v->start < a + n && a < v->end){
+      a = v->end;
+      goto again;
+    }
+  }
+  return a;
+}
+
+// Map len bytes of file f from offset off, or anonymous memory
+// if flags has MAP_ANONYMOUS, into the current process.
+// The address is chosen by the kernel; addr is only a hint,
+// and ignored. Returns the address, or -1.
+int
+mmap(uint addr, uint len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *fv;
+
+  if(len == 0 || len > KERNBASE - MMAPBASE || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    // Pages are not shared between processes, so a shared
+    // anonymous mapping would behave as a private one.
+    if(flags & MAP_SHARED)
+      return -1;
+    f = 0;
+    off = 0;
+  } else {
+    // An open inode's type never changes, so no lock is needed.
+    if(f == 0 || f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  fv = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->start == 0)
+      fv = v;
+  len = PGROUNDUP(len);
+  if(fv == 0 || (addr = vmaplace(p, len)) == 0)
+    return -1;
+
+  fv->start = addr;
+  fv->end = addr + len;
+  fv->prot = prot;
+  fv->flags = flags;
+  fv->f = f ? filedup(f) : 0;
+  fv->off = off;
+  return addr;
+}
+
+// Remove the pages of mapping v in [lo, hi) from p's page table.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint lo, uint hi)
+{
+  struct inode *ip;
+  pte_t *pte;
+  uint a;
+
+  for(a = lo; a < hi; a += PGSIZE){
+    if((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0 || (*pte & PTE_P) == 0)
+      continue;
+    if(v->f && ((v->flags & MAP_SHARED) || (*pte & PTE_W) == 0)){
+      ip = v->f->ip;
+      punmap(ip->dev, ip->inum, (a - v->start + v->off) / PGSIZE,
+             (v->flags & MAP_SHARED) && (*pte & PTE_D));
+    } else
+      kfree(P2V(PTE_ADDR(*pte)));
+    *pte = 0;
+  }
+}
+
+// Unmap [addr, addr+len) from the current process. The range
+// may cover parts of mappings, and a mapping with a hole made
+// in its middle becomes two. Returns 0, or -1 on a bad range
+// or if there is no slot for the second half of a split.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  uint end, lo, hi;
+
+  end = addr + PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || len == 0 || addr < MMAPBASE || end > KERNBASE || end <= addr)
+    return -1;
+
+  w = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start == 0)
+      w = v;
+  }
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start && v->start < addr && end < v->end && w == 0)
+      return -1;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start == 0 || end <= v->start || v->end <= addr)
+      continue;
+    lo = addr > v->start ? addr : v->start;
+    hi = end < v->end ? end : v->end;
+    vmaunmap(p, v, lo, hi);
+    if(lo == v->start && hi == v->end){
+      if(v->f)
+        fileclose(v->f);
+      v->start = 0;
+    } else if(lo == v->start){
+      v->off += hi - v->start;
+      v->start = hi;
+    } else if(hi == v->end){
+      v->end = lo;
+    } else {
+      *w = *v;
+      w->start = hi;
+      w->off = v->off + (hi - v->start);
+      if(w->f)
+        filedup(w->f);
+      v->end = lo;
+    }
+  }
+  lcr3(V2P(p->pgdir));
+  return 0;
+}
+
+// Unmap all of p's mappings, at exit() and exec(). Must come
+// before p's page table is freed: freevm() would kfree()
+// pages that belong to the page cache.
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start == 0)
+      continue;
+    vmaunmap(p, v, v->start, v->end);
+    if(v->f)
+      fileclose(v->f);
+    v->start = 0;
+  }
+  if(p == myproc())
+    lcr3(V2P(p->pgdir));
+}
+
+// Give child np copies of p's mappings, for fork(). Pages of
+// the page cache are left for the child to fault in again; its
+// anonymous pages and private copies are copied now.
+// Returns 0, or -1 if out of memory.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  char *mem;
+  uint a;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->start == 0)
+      continue;
+    *nv = *v;
+    if(v->f)
+      filedup(v->f);
+    if(v->f && (v->flags & MAP_SHARED))
+      continue;
+    for(a = v->start; a < v->end; a += PGSIZE){
+      if((pte = walkpgdir(p->pgdir, (char*)a, 0)) == 0 || (*pte & PTE_P) == 0)
+        continue;
+      if(v->f && (*pte & PTE_W) == 0)
+        continue;
+      if((mem = kalloc()) == 0)
+        return -1;
+      memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+      if(mappages(np->pgdir, (char*)a, PGSIZE, V2P(mem), PTE_FLAGS(*pte)) < 0){
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Handle a fault at va in a mapping of the current process;
+// write is non-zero for a store. Returns 0 once the page is
+// mapped, or -1 if va is in no mapping, the mapping does not
+// allow the access, va is past the end of the file, or memory
+// is short.
+int
+mmapfault(uint va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct page *pg;
+  pte_t *pte;
+  char *mem;
+  int perm;
+
+  if((v = vmafind(p, va)) == 0)
+    return -1;
+  if((v->prot & (PROT_READ|PROT_WRITE)) == 0 || (write && (v->prot & PROT_WRITE) == 0))
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0)
+    return -1;
+  perm = PTE_U | ((v->prot & PROT_WRITE) ? PTE_W : 0);
+
+  if(*pte & PTE_P){
+    // Only a store to a private mapping's cache page faults
+    // on a present page: give the process its own copy.
+    if(!write || v->f == 0 || (v->flags & MAP_SHARED) || (*pte & PTE_W))
+      return -1;
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+    punmap(v->f->ip->dev, v->f->ip->inum, (va - v->start + v->off) / PGSIZE, 0);
+    *pte = V2P(mem) | PTE_P | PTE_U | PTE_W;
+    lcr3(V2P(p->pgdir));
+    return 0;
+  }
+
+  if(v->f == 0){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    *pte = V2P(mem) | PTE_P | perm;
+    return 0;
+  }
+
+  if((pg = ipage(v->f->ip, (va - v->start + v->off) / PGSIZE)) == 0)
+    return -1;
+  if((v->flags & MAP_PRIVATE) && write){
+    if((mem = kalloc()) == 0){
+      punpin(pg);
+      return -1;
+    }
+    memmove(mem, pg->data, PGSIZE);
+    punpin(pg);
+    *pte = V2P(mem) | PTE_P | PTE_U | PTE_W;
+    return 0;
+  }
+  if(v->flags & MAP_PRIVATE)
+    perm &= ~PTE_W;
+  *pte = V2P(pg->data) | PTE_P | perm;
+  return 0;
+}
+
+// Check that [va, va+n) lies within one mapping of the current
+// process that allows the access a system call is about to make
+// (write non-zero if the kernel will store to it), and fault its
+// pages in now: the kernel must not fault on them later, maybe
+// holding locks. Returns 0, or -1 if the range is not valid.
+int
+mmapcheck(uint va, uint n, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint a;
+
+  if((v = vmafind(p, va)) == 0 || va + n > v->end || va + n < va)
+    return -1;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P) && (!write || (*pte & PTE_W)))
+      continue;
+    if(mmapfault(a, write) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Fetch the nul-terminated string at addr in a mapping, as
+// fetchstr() does. The kernel uses the string where it is, so
+// it must not be in memory that can change under it, as file
+// pages can: only anonymous mappings may hold strings.
+int
+mmapstr(uint addr, char **pp)
+{
+  struct vma *v;
+  char *s;
+
+  if((v = vmafind(myproc(), addr)) == 0 || v->f != 0)
+    return -1;
+  *pp = (char*)addr;
+  for(s = *pp; s < (char*)v->end; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && mmapcheck((uint)s, 1, 0) < 0)
+      return -1;
+    if(*s == 0)
+      return s - *pp;
+  }
+  return -1;
+}
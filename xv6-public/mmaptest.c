@@ -0,0 +1,131 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "mman.h"
+
+#define PGSIZE 4096
+#define NPG 4
+
+char buf[NPG*PGSIZE];
+char filename[16] = "mmap_file";
+
+void failed(const char *msg)
+{
+  printf(1, msg);
+  printf(1, "Test failed!!\n");
+  exit();
+}
+
+void makefile(void)
+{
+  int i, fd;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 23;
+  fd = open(filename, O_CREATE | O_RDWR);
+  if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf))
+    failed("File write error\n");
+  close(fd);
+}
+
+// Anonymous memory: zeroed, writable, copied by fork.
+void test1(void)
+{
+  char *p;
+  int i, pid;
+
+  printf(1, "Test 1: anonymous mapping\n");
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    failed("mmap error\n");
+  for (i = 0; i < NPG*PGSIZE; i++)
+    if (p[i] != 0)
+      failed("page not zeroed\n");
+  p[0] = 'x';
+  p[NPG*PGSIZE-1] = 'y';
+  if ((pid = fork()) == 0) {
+    if (p[0] != 'x' || p[NPG*PGSIZE-1] != 'y')
+      failed("child does not see parent's pages\n");
+    p[0] = 'z';
+    exit();
+  }
+  wait();
+  if (p[0] != 'x')
+    failed("child's store reached parent\n");
+  if (munmap(p + PGSIZE, PGSIZE) < 0 || munmap(p, NPG*PGSIZE) < 0)
+    failed("munmap error\n");
+  printf(1, "Test 1 passed\n\n");
+}
+
+// A shared mapping reads the file, and stores reach it.
+void test2(void)
+{
+  char *p, c;
+  int fd, i;
+
+  printf(1, "Test 2: shared file mapping\n");
+  fd = open(filename, O_RDWR);
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    failed("mmap error\n");
+  for (i = 0; i < NPG*PGSIZE; i++)
+    if (p[i] != buf[i])
+      failed("mapping differs from file\n");
+  p[PGSIZE+1] = '#';
+  if (munmap(p, NPG*PGSIZE) < 0)
+    failed("munmap error\n");
+  close(fd);
+
+  fd = open(filename, O_RDONLY);
+  if (read(fd, buf, PGSIZE+2) != PGSIZE+2 || buf[PGSIZE+1] != '#')
+    failed("store did not reach the file\n");
+  close(fd);
+
+  // read() into a shared mapping of another page of the file.
+  fd = open(filename, O_RDWR);
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 2*PGSIZE);
+  if (p == MAP_FAILED || read(fd, p, 100) != 100 || p[0] != 'a')
+    failed("read into mapping error\n");
+  c = p[PGSIZE-1];
+  munmap(p, PGSIZE);
+  close(fd);
+  if (c != 'a' + (3*PGSIZE-1) % 23)
+    failed("mapping offset error\n");
+  printf(1, "Test 2 passed\n\n");
+}
+
+// A private mapping's stores stay private.
+void test3(void)
+{
+  char *p, c;
+  int fd;
+
+  printf(1, "Test 3: private file mapping\n");
+  fd = open(filename, O_RDONLY);
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    failed("mmap error\n");
+  c = p[5];
+  p[5] = c + 1;
+  if (p[5] != c + 1)
+    failed("private store lost\n");
+  munmap(p, NPG*PGSIZE);
+  if (read(fd, buf, 6) != 6 || buf[5] != c)
+    failed("private store reached the file\n");
+  if (mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED)
+    failed("writable shared mapping of read-only file\n");
+  close(fd);
+  printf(1, "Test 3 passed\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+  makefile();
+  test1();
+  test2();
+  test3();
+  unlink(filename);
+  printf(1, "All tests passed!!\n");
+  exit();
+}
@@ -0,0 +1,18 @@
+// A page of a regular file's data, cached by pcache.c.
+struct page {
+  int flags;
+  uint dev;
+  uint inum;           // the file's inode; 0 if unused
+  uint pgno;           // which page of the file: offset / PGSIZE
+  struct sleeplock lock;
+  int ref;
+  uint dirtied;        // ticks when it was last made dirty
+  struct page *hnext;  // hash chain
+  struct page *prev;   // LRU list
+  struct page *next;
+  char *data;          // PGSIZE bytes from kalloc()
+};
+#define P_VALID 0x2  // page holds the file's data
+#define P_DIRTY 0x4  // page is newer than the disk
+
+#define PGBLOCKS (PGSIZE / BSIZE)  // file blocks per page
@@ -3,11 +3,29 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE      200  // i-nodes to keep cached; more if all are in use
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       20000  // size of file system in blocks
+#define IPUTBLOCKS    8  // max # of blocks iput() writes freeing an inode:
+                         // inode, inode map, orphan list and 5 bitmap or
+                         // indirect blocks; truncd frees any more
+#define TRUNCBLOCKS  64  // max # of blocks truncd writes per transaction
+#define DIRLINKBLOCKS 16  // max # of blocks dirlink() writes: an indexed
+                          // insert that splits every level, with bitmap
+                          // and indirect blocks
+#define CREATEBLOCKS  (6+DIRLINKBLOCKS)  // max # of blocks create() writes
+#define LOGSIZE      256  // max blocks in a transaction
+#define LOGBLOCKS    (LOGSIZE*4)  // max size of the on-disk log ring
+#define NBUF         (LOGBLOCKS+LOGSIZE*2+64)  // size of disk block cache; holds the log pins
+#define LOGTIMEOUT   100  // ticks a transaction may stay open before commit
+#define CKPTDELAY    500  // idle ticks before committed blocks are written home
+#define LOGORDERED   1  // journal metadata only; write file data in place
+#define NFREED       32  // freed block runs the log tracks per transaction
+#define FSSIZE       20000  // default size of file system mkfs makes, in blocks
+#define NBGROUP      8192  // maximum number of block groups (BPB blocks, 2MB, each)
+#define NPAGE        1024  // pages of file data to cache; more if all are in use
+#define WBDELAY       300  // ticks a dirty page waits before writeback
+#define NVMA          16  // memory mappings per process
+#define MAXIOV        32  // max buffers for readv() and writev()
@@ -0,0 +1,449 @@
+// Page cache.
+//
+// The page cache holds the content of regular files in 4096-byte
+// pages, named by inode and page number, so that read() and
+// write() copy whole runs of a file without a buffer cache
+// lookup per 512-byte block.
+//
+// write() only fills pages and marks them dirty; no disk block
+// is allocated and nothing is logged. The writeback thread, or
+// fsync(), later writes the dirty pages of a file in one
+// transaction per batch (see iflush in fs.c), and only then are
+// disk blocks allocated for the parts of the file new on disk.
+// Allocating many blocks at once lets them be one contiguous run,
+// which is one extent and one disk request.
+//
+// Interface:
+// * pget() returns a locked page, which may not hold data
+//   yet (P_VALID clear); fs.c fills it from the disk.
+// * After changing page data, call pdirty().
+// * When done with the page, call pput().
+// * The caller must hold the file's inode lock, shared to read
+//   a page and exclusive to change one, so pages are only
+//   referenced while their inode is locked.
+// * The exception is mmap(), and sendfile(): ppin() keeps a
+//   reference to a page while it is mapped into a process or
+//   being sent, and punmap() or punpin() drops it.
+//
+// Pages that are not dirty and not referenced are recycled in
+// LRU order. To be sure that some always are, write() calls
+// pthrottle() before each chunk it writes, which holds the number
+// of dirty pages to DIRTYMAX plus a chunk per writer. Mapped
+// pages can't be recycled, so if none can the cache grows past
+// NPAGE pages while kalloc() finds memory, and shrinks back as
+// pages are released.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "page.h"
+
+#define NPHASH 251
+#define DIRTYBG  (NPAGE/8)  // writeback starts at once above this many
+#define DIRTYMAX (NPAGE/4)  // writers wait for writeback above this many
+
+// The writeback thread sleeps on &pcache.ndirty.
+// Processes waiting for pages to be cleaned sleep on &pcache.
+struct {
+  struct spinlock lock;
+  struct page *hash[NPHASH];
+  struct page head;  // LRU list of pages with data; head.next is most recently used
+  struct page *free; // struct pages without data, linked by next
+  int n;             // pages on the LRU list
+  int ndirty;        // pages with P_DIRTY set
+  int waiting;       // processes waiting for clean pages
+} pcache;
+
+#define PHASH(dev, inum, pgno) ((((dev)*31 + (inum))*37 + (pgno)) % NPHASH)
+
+static void writeback(void);
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  kproc("writeback", writeback);
+}
+
+// Move p to the front of the LRU list, or to the back.
+static void
+pmove(struct page *p, int front)
+{
+  p->next->prev = p->prev;
+  p->prev->next = p->next;
+  if(front){
+    p->next = pcache.head.next;
+    p->prev = &pcache.head;
+  } else {
+    p->next = &pcache.head;
+    p->prev = pcache.head.prev;
+  }
+  p->next->prev = p;
+  p->prev->next = p;
+}
+
+// Take p off its hash chain and mark it unused.
+static void
+punhash(struct page *p)
+{
+  struct page **pp;
+
+  if(p->inum == 0)
+    return;
+  for(pp = &pcache.hash[PHASH(p->dev, p->inum, p->pgno)]; *pp != p; pp = &(*pp)->hnext)
+    ;
+  *pp = p->hnext;
+  p->inum = 0;
+}
+
+// Return a new page with data, at the back of the LRU list,
+// or 0 if out of memory. Caller holds pcache.lock.
+static struct page*
+palloc(void)
+{
+  struct page *p, *e;
+
+  if(pcache.free == 0 && (e = (struct page*)kalloc()) != 0){
+    memset(e, 0, PGSIZE);
+    for(p = e; p < e + PGSIZE/sizeof(*p); p++){
+      initsleeplock(&p->lock, "page");
+      p->next = pcache.free;
+      pcache.free = p;
+    }
+  }
+  if((p = pcache.free) == 0 || (p->data = kalloc()) == 0)
+    return 0;
+  pcache.free = p->next;
+  p->next = &pcache.head;
+  p->prev = pcache.head.prev;
+  p->next->prev = p;
+  p->prev->next = p;
+  pcache.n++;
+  return p;
+}
+
+// Give the data of clean, unreferenced page p back to kalloc.
+// Caller holds pcache.lock.
+static void
+pfree(struct page *p)
+{
+  punhash(p);
+  p->next->prev = p->prev;
+  p->prev->next = p->next;
+  kfree(p->data);
+  p->data = 0;
+  p->flags = 0;
+  p->next = pcache.free;
+  pcache.free = p;
+  pcache.n--;
+}
+
+// Return the locked page pgno of inode inum on device dev,
+// recycling the least recently used clean page if it is not
+// cached.
+struct page*
+pget(uint dev, uint inum, uint pgno)
+{
+  struct page *p;
+
+  acquire(&pcache.lock);
+  for(;;){
+    for(p = pcache.hash[PHASH(dev, inum, pgno)]; p; p = p->hnext){
+      if(p->dev == dev && p->inum == inum && p->pgno == pgno){
+        p->ref++;
+        goto found;
+      }
+    }
+
+    p = 0;
+    if(pcache.n < NPAGE)
+      p = palloc();
+    if(p == 0){
+      for(p = pcache.head.prev; p != &pcache.head; p = p->prev)
+        if(p->ref == 0 && (p->flags & P_DIRTY) == 0)
+          break;
+      if(p == &pcache.head)
+        p = palloc();
+    }
+    if(p){
+      punhash(p);
+      p->dev = dev;
+      p->inum = inum;
+      p->pgno = pgno;
+      p->flags = 0;
+      p->ref = 1;
+      p->hnext = pcache.hash[PHASH(dev, inum, pgno)];
+      pcache.hash[PHASH(dev, inum, pgno)] = p;
+      goto found;
+    }
+
+    // Every page is dirty or in use, and memory is short:
+    // wait for writeback.
+    pcache.waiting++;
+    wakeup(&pcache.ndirty);
+    sleep(&pcache, &pcache.lock);
+    pcache.waiting--;
+  }
+
+found:
+  release(&pcache.lock);
+  acquiresleep(&p->lock);
+  return p;
+}
+
+// Drop a reference to p. Caller holds pcache.lock.
+static void
+prelease(struct page *p)
+{
+  if(--p->ref == 0){
+    if(pcache.n > NPAGE && (p->flags & P_DIRTY) == 0)
+      pfree(p);
+    else
+      pmove(p, 1);
+    if((p->flags & P_DIRTY) == 0)
+      wakeup(&pcache);
+  }
+}
+
+// Release a locked page.
+void
+pput(struct page *p)
+{
+  if(!holdingsleep(&p->lock))
+    panic("pput");
+
+  releasesleep(&p->lock);
+
+  acquire(&pcache.lock);
+  prelease(p);
+  release(&pcache.lock);
+}
+
+// Take a reference to locked page p for a mapping or for
+// sendfile(), which keeps it cached after pput() until
+// punpin() or punmap().
+void
+ppin(struct page *p)
+{
+  if(!holdingsleep(&p->lock))
+    panic("ppin");
+
+  acquire(&pcache.lock);
+  p->ref++;
+  release(&pcache.lock);
+}
+
+// Drop the reference a mapping took with ppin() on page pgno
+// of inode inum, first marking it dirty if the mapping has
+// written to it.
+void
+punmap(uint dev, uint inum, uint pgno, int dirty)
+{
+  struct page *p;
+
+  acquire(&pcache.lock);
+  for(p = pcache.hash[PHASH(dev, inum, pgno)]; p; p = p->hnext)
+    if(p->dev == dev && p->inum == inum && p->pgno == pgno)
+      break;
+  if(p == 0 || p->ref < 1)
+    panic("punmap");
+  release(&pcache.lock);
+
+  if(dirty){
+    acquiresleep(&p->lock);
+    pdirty(p);
+    releasesleep(&p->lock);
+  }
+  punpin(p);
+}
+
+// Drop a reference taken with ppin().
+void
+punpin(struct page *p)
+{
+  acquire(&pcache.lock);
+  if(p->ref < 1)
+    panic("punpin");
+  prelease(p);
+  release(&pcache.lock);
+}
+
+// Caller has modified locked page p.
+void
+pdirty(struct page *p)
+{
+  if(!holdingsleep(&p->lock))
+    panic("pdirty");
+
+  acquire(&pcache.lock);
+  if((p->flags & P_DIRTY) == 0){
+    p->flags |= P_DIRTY;
+    pcache.ndirty++;
+  }
+  p->dirtied = ticks;
+  release(&pcache.lock);
+}
+
+// Caller has written locked page p to disk.
+void
+pclean(struct page *p)
+{
+  if(!holdingsleep(&p->lock))
+    panic("pclean");
+
+  acquire(&pcache.lock);
+  if(p->flags & P_DIRTY){
+    p->flags &= ~P_DIRTY;
+    pcache.ndirty--;
+    wakeup(&pcache);
+  }
+  release(&pcache.lock);
+}
+
+// Return in pv up to max of the dirty pages of inode inum,
+// locked and in ascending order from the lowest. Returns how
+// many there are.
+int
+pdirtyv(uint dev, uint inum, struct page **pv, int max)
+{
+  struct page *p;
+  int i, n;
+
+  n = 0;
+  acquire(&pcache.lock);
+  for(p = pcache.head.next; p != &pcache.head; p = p->next){
+    if((p->flags & P_DIRTY) == 0 || p->inum != inum || p->dev != dev)
+      continue;
+    if(n == max && pv[n-1]->pgno < p->pgno)
+      continue;
+    if(n < max)
+      n++;
+    for(i = n-1; i > 0 && pv[i-1]->pgno > p->pgno; i--)
+      pv[i] = pv[i-1];
+    pv[i] = p;
+  }
+  for(i = 0; i < n; i++)
+    pv[i]->ref++;
+  release(&pcache.lock);
+
+  for(i = 0; i < n; i++)
+    acquiresleep(&pv[i]->lock);
+  return n;
+}
+
+// Discard the cached pages of inode inum, dirty or not,
+// because the inode is being freed. The caller holds the
+// inode's lock exclusively, so none of them is in use.
+void
+pdrop(uint dev, uint inum)
+{
+  struct page *p, *next;
+
+  acquire(&pcache.lock);
+  for(p = pcache.head.next; p != &pcache.head; p = next){
+    next = p->next;
+    if(p->inum != inum || p->dev != dev)
+      continue;
+    if(p->ref != 0)
+      panic("pdrop");
+    if(p->flags & P_DIRTY)
+      pcache.ndirty--;
+    p->flags = 0;
+    if(pcache.n > NPAGE)
+      pfree(p);
+    else {
+      punhash(p);
+      pmove(p, 0);
+    }
+  }
+  wakeup(&pcache);
+  release(&pcache.lock);
+}
+
+// Wait while too many pages are dirty. Called by writers
+// before they lock the inode, so that writeback can lock it.
+void
+pthrottle(void)
+{
+  acquire(&pcache.lock);
+  while(pcache.ndirty >= DIRTYMAX){
+    pcache.waiting++;
+    wakeup(&pcache.ndirty);
+    sleep(&pcache, &pcache.lock);
+    pcache.waiting--;
+  }
+  release(&pcache.lock);
+}
+
+// Write back every file with pages dirtied before the call,
+// for sync().
+void
+psync(void)
+{
+  struct page *p;
+  uint dev, inum, start;
+
+  acquire(&pcache.lock);
+  start = ticks;
+  for(;;){
+    for(p = pcache.head.next; p != &pcache.head; p = p->next)
+      if((p->flags & P_DIRTY) && (int)(p->dirtied - start) <= 0)
+        break;
+    if(p == &pcache.head)
+      break;
+    dev = p->dev;
+    inum = p->inum;
+    release(&pcache.lock);
+    iwriteback(dev, inum);
+    acquire(&pcache.lock);
+  }
+  release(&pcache.lock);
+}
+
+// Called on each timer tick: every so often, wake the
+// writeback thread to look for pages that have been dirty
+// for WBDELAY ticks. Reads pcache without the lock; a stale
+// view only delays writeback to a later tick.
+void
+pcache_tick(uint now)
+{
+  if(pcache.ndirty > 0 && now % (WBDELAY/4) == 0)
+    wakeup(&pcache.ndirty);
+}
+
+// The writeback thread. Writes out the file holding the
+// oldest dirty page once that page has waited WBDELAY ticks,
+// or at once if too many pages are dirty or someone is
+// waiting for a clean one.
+static void
+writeback(void)
+{
+  struct page *p, *old;
+  uint dev, inum;
+
+  acquire(&pcache.lock);
+  for(;;){
+    old = 0;
+    for(p = pcache.head.next; p != &pcache.head; p = p->next){
+      if((p->flags & P_DIRTY) && (old == 0 || (int)(p->dirtied - old->dirtied) < 0))
+        old = p;
+    }
+    if(old == 0 || (pcache.ndirty < DIRTYBG && pcache.waiting == 0 &&
+                    ticks - old->dirtied < WBDELAY)){
+      sleep(&pcache.ndirty, &pcache.lock);
+      continue;
+    }
+    dev = old->dev;
+    inum = old->inum;
+    release(&pcache.lock);
+    iwriteback(dev, inum);
+    acquire(&pcache.lock);
+  }
+}
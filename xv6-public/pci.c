@@ -0,0 +1,69 @@
+// PCI configuration space, through the legacy 0xCF8/0xCFC
+// ports. Enough to find a device on bus 0 and read its
+// base address registers.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+#define PCI_ADDR  0xcf8
+#define PCI_DATA  0xcfc
+
+static uint
+pciaddr(struct pcidev *d, int off)
+{
+  return 0x80000000 | (d->bus<<16) | (d->dev<<11) | (d->func<<8) | (off & 0xfc);
+}
+
+uint
+pciread(struct pcidev *d, int off)
+{
+  outl(PCI_ADDR, pciaddr(d, off));
+  return inl(PCI_DATA);
+}
+
+void
+pciwrite(struct pcidev *d, int off, uint v)
+{
+  outl(PCI_ADDR, pciaddr(d, off));
+  outl(PCI_DATA, v);
+}
+
+// Find the first function on bus 0 with the given vendor and
+// device ids and fill in d. Returns 0, or -1 if there is none.
+int
+pcifind(ushort vendor, ushort device, struct pcidev *d)
+{
+  uint id, class;
+  int i;
+
+  d->bus = 0;
+  for(d->dev = 0; d->dev < 32; d->dev++){
+    for(d->func = 0; d->func < 8; d->func++){
+      id = pciread(d, PCI_ID);
+      if((id & 0xffff) == 0xffff){
+        if(d->func == 0)
+          break;  // no device in this slot
+        continue;
+      }
+      if((id & 0xffff) != vendor || (id >> 16) != device)
+        continue;
+      class = pciread(d, PCI_CLASS);
+      d->class = class >> 24;
+      d->subclass = (class >> 16) & 0xff;
+      for(i = 0; i < 6; i++)
+        d->bar[i] = pciread(d, PCI_BAR0 + 4*i);
+      d->irq = pciread(d, PCI_INTR) & 0xff;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Let d master the bus, as DMA engines must.
+void
+pcimaster(struct pcidev *d)
+{
+  pciwrite(d, PCI_CMD, pciread(d, PCI_CMD) | PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_MASTER);
+}
@@ -0,0 +1,24 @@
+// PCI configuration space.
+
+#define PCI_ID      0x00  // device id << 16 | vendor id
+#define PCI_CMD     0x04  // status << 16 | command
+#define PCI_CLASS   0x08  // class, subclass, prog if, revision
+#define PCI_BAR0    0x10  // six base address registers
+#define PCI_INTR    0x3c  // interrupt line in the low byte
+
+#define PCI_CMD_IO      0x1  // respond to I/O space accesses
+#define PCI_CMD_MEM     0x2  // respond to memory space accesses
+#define PCI_CMD_MASTER  0x4  // may master the bus
+
+#define PCI_BAR_IO      0x1  // BAR maps I/O space
+#define PCI_BAR_IOMASK  0xfffffffc
+
+struct pcidev {
+  uint bus;
+  uint dev;
+  uint func;
+  uchar class;
+  uchar subclass;
+  uchar irq;
+  uint bar[6];
+};
@@ -121,6 +121,30 @@ found:
   return p;
 }
 
+// Create a kernel thread that runs fn(), which must never
+// return. It has no user memory and never leaves the kernel:
+// forkret() returns into fn instead of trapret.
+struct proc*
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc: no procs");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kproc: out of memory?");
+  memset(p->tf, 0, sizeof(*p->tf));
+  *(uint*)(p->context + 1) = (uint)fn;
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+
+  return p;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -202,6 +226,14 @@ fork(void)
     np->state = UNUSED;
     return -1;
   }
+  if(mmapcopy(curproc, np) < 0){
+    munmapall(np);
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   np->sz = curproc->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
@@ -240,6 +272,10 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // Unmap mappings, handing pages stored to through shared
+  // ones to writeback, and close their files.
+  munmapall(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -248,7 +284,7 @@ exit(void)
     }
   }
 
-  begin_op();
+  begin_op(IPUTBLOCKS);
   iput(curproc->cwd);
   end_op();
   curproc->cwd = 0;
@@ -676,9 +712,12 @@ forkret(void)
     // Some initialization functions must be run in the context
     // of a regular process (e.g., they call sleep), and thus cannot
     // be run from main().
+    // initlog() first: iinit() counts free blocks in the
+    // bitmaps, which log recovery may change.
     first = 0;
-    iinit(ROOTDEV);
     initlog(ROOTDEV);
+    iinit(ROOTDEV);
+    pcacheinit();
   }
 
   // Return to "caller", actually trapret (see allocproc).
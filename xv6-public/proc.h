@@ -32,6 +32,17 @@ struct context {
   uint eip;
 };
 
+// A memory mapping made by mmap(): pages [start, end) show
+// the file f from offset off, or zeroed memory if f is 0.
+struct vma {
+  uint start;                  // 0 if the slot is unused
+  uint end;
+  int prot;                    // PROT_ bits from mman.h
+  int flags;                   // MAP_ bits
+  struct file *f;
+  uint off;
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -61,6 +72,11 @@ struct proc {
   int level;
   int ismono;
   int timeq;
+
+  int logres;                  // log blocks reserved by the current FS op
+  int logused;                 // log blocks it has added
+
+  struct vma vma[NVMA];        // Memory mappings (see mmap.c)
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -68,3 +84,5 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+// and above it, from MMAPBASE up to KERNBASE:
+//   mappings made by mmap()
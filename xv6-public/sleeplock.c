@@ -16,6 +16,8 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->waiting = 0;
   lk->pid = 0;
 }
 
@@ -23,9 +25,11 @@ void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->waiting++;
+  while (lk->locked || lk->readers) {
     sleep(lk, &lk->lk);
   }
+  lk->waiting--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
   release(&lk->lk);
@@ -41,6 +45,31 @@ releasesleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// Acquire lk shared with other readers. Waits while anyone
+// holds or waits for it exclusively, so a stream of readers
+// cannot starve a writer.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->locked || lk->waiting) {
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
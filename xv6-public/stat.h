@@ -8,4 +8,37 @@ struct stat {
   uint ino;    // Inode number
   short nlink; // Number of links to file
   uint size;   // Size of file in bytes
+  uint blocks; // Disk blocks allocated to it
+};
+
+// Log usage of one kind of system call, for logstat().
+struct logstat {
+  uint ops;       // FS ops begun
+  uint reserved;  // log blocks they reserved
+  uint logged;    // log blocks they added
+  uint maxlogged; // most blocks one op added
+  uint over;      // ops that added more than they reserved
+};
+
+// Counters of the log as a whole, for logstat().
+struct logtotal {
+  uint commits;   // records written to the log
+  uint blocks;    // blocks logged in them
+  uint forced;    // transactions closed by fsync
+  uint ckpts;     // records checkpointed
+};
+
+#define NLOGSTAT 64  // logstat() slots, indexed by syscall number
+
+// Disk request statistics, for iostat().
+struct iostat {
+  uint reqs;      // commands sent to the disk
+  uint blocks;    // blocks they moved
+  uint arrivals;  // requests queued
+  uint merged;    // requests merged into a queued one
+  uint depthsum;  // queue depth seen by each arrival
+  uint maxdepth;  // most requests queued at once
+  uint deadline;  // requests served early because they aged
+  uint waitticks; // ticks commands spent queued
+  uint svcticks;  // ticks the disk spent serving them
 };
@@ -19,7 +19,7 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if((addr >= curproc->sz || addr+4 > curproc->sz) && mmapcheck(addr, 4, 0) < 0)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -35,7 +35,7 @@ fetchstr(uint addr, char **pp)
   struct proc *curproc = myproc();
 
   if(addr >= curproc->sz)
-    return -1;
+    return mmapstr(addr, pp);
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
@@ -52,27 +52,56 @@ argint(int n, int *ip)
   return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// Check that the size bytes at addr lie within the process
+// address space: below sz, or in one mapping made by mmap(),
+// which must be writable if write is set.
 int
-argptr(int n, char **pp, int size)
+fetchbuf(uint addr, int size, int write)
 {
-  int i;
   struct proc *curproc = myproc();
+
+  if(size < 0)
+    return -1;
+  if((addr >= curproc->sz || addr+size > curproc->sz) &&
+     mmapcheck(addr, size, write) < 0)
+    return -1;
+  return 0;
+}
+
+static int
+fetchptr(int n, char **pp, int size, int write)
+{
+  int i;
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(fetchbuf(i, size, write) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
+// Fetch the nth word-sized system call argument as a pointer
+// to a block of memory of size bytes.  Check that the pointer
+// lies within the process address space (see fetchbuf).
+int
+argptr(int n, char **pp, int size)
+{
+  return fetchptr(n, pp, size, 0);
+}
+
+// Like argptr, for memory the kernel will store to, which
+// must then be writable.
+int
+argptrw(int n, char **pp, int size)
+{
+  return fetchptr(n, pp, size, 1);
+}
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (Strings can't be in shared memory (see mmapstr), so the string
+// can't change between this check and being used by the kernel.)
 int
 argstr(int n, char **pp)
 {
@@ -110,6 +139,21 @@ extern int sys_schedprac2(void);
 extern int sys_getlev(void);
 extern int sys_setpriority(void);
 extern int sys_monopolize(void);
+extern int sys_fsync(void);
+extern int sys_logstat(void);
+extern int sys_iostat(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_sendfile(void);
+extern int sys_splice(void);
+extern int sys_lseek(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_fallocate(void);
+extern int sys_fdatasync(void);
+extern int sys_sync(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -140,6 +184,21 @@ static int (*syscalls[])(void) = {
 [SYS_getlev]  sys_getlev,
 [SYS_setpriority]  sys_setpriority,
 [SYS_monopolize]  sys_monopolize,
+[SYS_fsync]   sys_fsync,
+[SYS_logstat] sys_logstat,
+[SYS_iostat]  sys_iostat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_sendfile] sys_sendfile,
+[SYS_splice]  sys_splice,
+[SYS_lseek]   sys_lseek,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_fallocate] sys_fallocate,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_sync]    sys_sync,
 };
 
 void
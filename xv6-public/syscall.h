@@ -27,3 +27,18 @@
 #define SYS_getlev 26
 #define SYS_setpriority 27
 #define SYS_monopolize 28
+#define SYS_fsync  29
+#define SYS_logstat 30
+#define SYS_iostat 31
+#define SYS_mmap   32
+#define SYS_munmap 33
+#define SYS_sendfile 34
+#define SYS_splice 35
+#define SYS_lseek  36
+#define SYS_pread  37
+#define SYS_pwrite 38
+#define SYS_readv  39
+#define SYS_writev 40
+#define SYS_fallocate 41
+#define SYS_fdatasync 42
+#define SYS_sync   43
@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "uio.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -73,7 +75,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptrw(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -90,6 +92,132 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Copy n bytes of file in, at *off if off is not 0, to out
+// without passing them through user memory.
+int
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int n, uoff;
+  uint off, *offp;
+
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 ||
+     argint(2, &uoff) < 0 || argint(3, &n) < 0)
+    return -1;
+  if(in->type != FD_INODE || in->ip->type != T_FILE)
+    return -1;
+  offp = 0;
+  if(uoff && argptrw(2, (void*)&offp, sizeof(*offp)) < 0)
+    return -1;
+  if(offp)
+    off = *offp;
+  n = filesend(out, in, offp ? &off : 0, n);
+  if(offp)
+    *offp = off;
+  return n;
+}
+
+// Move up to n bytes from in to out, one of which must be a
+// pipe, without passing them through user memory.
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(in->type != FD_PIPE && out->type != FD_PIPE)
+    return -1;
+  return filesend(out, in, 0, n);
+}
+
+// Fetch the nth system call argument as an array of niov
+// iovecs, copied to iov, and check their buffers, which
+// the kernel will store to if write is set.
+static int
+argiov(int n, int niov, struct iovec *iov, int write)
+{
+  struct iovec *uiov;
+  int i;
+
+  if(niov < 0 || niov > MAXIOV || argptr(n, (void*)&uiov, niov*sizeof(*uiov)) < 0)
+    return -1;
+  for(i = 0; i < niov; i++){
+    iov[i] = uiov[i];
+    if(fetchbuf((uint)iov[i].iov_base, iov[i].iov_len, write) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argiov(1, n, iov, 1) < 0)
+    return -1;
+  return filereadv(f, iov, n, 0);
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argiov(1, n, iov, 0) < 0)
+    return -1;
+  return filewritev(f, iov, n, 0);
+}
+
+// Read n bytes at offset off, leaving the file's offset alone.
+int
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n;
+  uint off;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptrw(1, (void*)&iov.iov_base, n) < 0 ||
+     argint(3, (int*)&off) < 0)
+    return -1;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, &off);
+}
+
+// Write n bytes at offset off, leaving the file's offset alone.
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n;
+  uint off;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, (void*)&iov.iov_base, n) < 0 ||
+     argint(3, (int*)&off) < 0)
+    return -1;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, &off);
+}
+
+int
+sys_lseek(void)
+{
+  struct file *f;
+  int off, whence;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &whence) < 0)
+    return -1;
+  return fileseek(f, off, whence);
+}
+
 int
 sys_close(void)
 {
@@ -103,13 +231,124 @@ sys_close(void)
   return 0;
 }
 
+// Write out the dirty pages of argument 0's file, then wait
+// for the last transaction that changed its data, and with
+// all its inode too, to commit. Transactions since then are
+// left running, and a file whose changes have committed
+// already, or went in place, needs no commit at all.
+static int
+fdsync(int all)
+{
+  struct file *f;
+  uint tid;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  iflush(f->ip);
+  ilock(f->ip);
+  tid = f->ip->datatid;
+  if(all && (int)(f->ip->synctid - tid) > 0)
+    tid = f->ip->synctid;
+  iunlock(f->ip);
+  log_wait(tid);
+  return 0;
+}
+
+// Wait until everything written to fd so far is on disk.
+int
+sys_fsync(void)
+{
+  return fdsync(1);
+}
+
+// Like fsync(), but don't wait for changes to the inode
+// that reading the data doesn't need, such as its link count.
+int
+sys_fdatasync(void)
+{
+  return fdsync(0);
+}
+
+// Write back every file's data and commit every finished
+// system call's updates.
+int
+sys_sync(void)
+{
+  psync();
+  log_force();
+  return 0;
+}
+
+// Set aside disk blocks for len bytes of a file from offset
+// off, so that writing them later can't run out of space
+// and lands in one contiguous run.
+int
+sys_fallocate(void)
+{
+  struct file *f;
+  int off, len;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &len) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->writable || off < 0 || len <= 0)
+    return -1;
+  return ifallocate(f->ip, off, len);
+}
+
+int
+sys_mmap(void)
+{
+  struct file *f;
+  int addr, len, prot, flags, off;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  f = 0;
+  if(!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+int
+sys_logstat(void)
+{
+  struct logstat *st;
+  struct logtotal *t;
+  int n, tp;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > NLOGSTAT)
+    n = NLOGSTAT;
+  if(argptrw(0, (void*)&st, n*sizeof(*st)) < 0)
+    return -1;
+  if(argint(2, &tp) < 0)
+    return -1;
+  t = 0;
+  if(tp && argptrw(2, (void*)&t, sizeof(*t)) < 0)
+    return -1;
+  return logstat(st, n, t);
+}
+
+int
+sys_iostat(void)
+{
+  struct iostat *st;
+
+  if(argptrw(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  idestat(st);
+  return 0;
+}
+
 int
 sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argptrw(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -124,7 +363,7 @@ sys_link(void)
   if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
     return -1;
 
-  begin_op();
+  begin_op(1+DIRLINKBLOCKS);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -164,35 +403,18 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 //PAGEBREAK!
 int
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], *path;
   uint off;
 
   if(argstr(0, &path) < 0)
     return -1;
 
-  begin_op();
+  begin_op(4+IPUTBLOCKS);
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -215,9 +437,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -226,6 +446,8 @@ sys_unlink(void)
 
   ip->nlink--;
   iupdate(ip);
+  if(ip->nlink == 0)
+    iorphan(ip);
   iunlockput(ip);
 
   end_op();
@@ -274,8 +496,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  // An indexed directory may have no room for the name.
+  if(dirlink(dp, name, ip->inum) < 0){
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -293,7 +525,7 @@ sys_open(void)
   if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  begin_op((omode & O_CREATE) ? CREATEBLOCKS : IPUTBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -338,7 +570,7 @@ sys_mkdir(void)
   char *path;
   struct inode *ip;
 
-  begin_op();
+  begin_op(CREATEBLOCKS);
   if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -355,7 +587,7 @@ sys_mknod(void)
   char *path;
   int major, minor;
 
-  begin_op();
+  begin_op(CREATEBLOCKS);
   if((argstr(0, &path)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -375,7 +607,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *curproc = myproc();
   
-  begin_op();
+  begin_op(IPUTBLOCKS);
   if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -426,7 +658,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argptrw(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
@@ -103,6 +103,16 @@ sys_sbrk(void)
   return addr;
 }
 
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
+
 int
 sys_sleep(void)
 {
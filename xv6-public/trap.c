@@ -66,6 +66,8 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      log_tick(ticks);
+      pcache_tick(ticks);
     }
     lapiceoi();
     break;
@@ -91,8 +93,19 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // A page of an mmap() mapping not yet mapped in.
+    if(myproc() && (tf->cs&3) == DPL_USER && mmapfault(rcr2(), tf->err & FEC_WR) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(virtioirq && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
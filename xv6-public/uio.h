@@ -0,0 +1,5 @@
+// A buffer of a vectored read or write (readv, writev).
+struct iovec {
+  void *iov_base;
+  int iov_len;
+};
@@ -1,5 +1,9 @@
 struct stat;
+struct logstat;
+struct logtotal;
+struct iostat;
 struct rtcdate;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -30,6 +34,21 @@ void schedprac2(void);
 int getlev(void);
 int setpriority(int, int);
 void monopolize(int);
+int fsync(int);
+int logstat(struct logstat*, int, struct logtotal*);
+int iostat(struct iostat*);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int sendfile(int, int, uint*, int);
+int splice(int, int, int);
+int lseek(int, int, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int fallocate(int, int, int);
+int fdatasync(int);
+int sync(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -1201,44 +1201,44 @@ bigfile(void)
 }
 
 void
-fourteen(void)
+thirty(void)
 {
   int fd;
 
-  // DIRSIZ is 14.
-  printf(1, "fourteen test\n");
+  // DIRSIZ is 30.
+  printf(1, "thirty test\n");
 
-  if(mkdir("12345678901234") != 0){
-    printf(1, "mkdir 12345678901234 failed\n");
+  if(mkdir("123456789012345678901234567890") != 0){
+    printf(1, "mkdir 123456789012345678901234567890 failed\n");
     exit();
   }
-  if(mkdir("12345678901234/123456789012345") != 0){
-    printf(1, "mkdir 12345678901234/123456789012345 failed\n");
+  if(mkdir("123456789012345678901234567890/1234567890123456789012345678901") != 0){
+    printf(1, "mkdir 123456789012345678901234567890/1234567890123456789012345678901 failed\n");
     exit();
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+  fd = open("1234567890123456789012345678901/1234567890123456789012345678901/1234567890123456789012345678901", O_CREATE);
   if(fd < 0){
-    printf(1, "create 123456789012345/123456789012345/123456789012345 failed\n");
+    printf(1, "create 1234567890123456789012345678901/1234567890123456789012345678901/1234567890123456789012345678901 failed\n");
     exit();
   }
   close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  fd = open("123456789012345678901234567890/123456789012345678901234567890/123456789012345678901234567890", 0);
   if(fd < 0){
-    printf(1, "open 12345678901234/12345678901234/12345678901234 failed\n");
+    printf(1, "open 123456789012345678901234567890/123456789012345678901234567890/123456789012345678901234567890 failed\n");
     exit();
   }
   close(fd);
 
-  if(mkdir("12345678901234/12345678901234") == 0){
-    printf(1, "mkdir 12345678901234/12345678901234 succeeded!\n");
+  if(mkdir("123456789012345678901234567890/123456789012345678901234567890") == 0){
+    printf(1, "mkdir 123456789012345678901234567890/123456789012345678901234567890 succeeded!\n");
     exit();
   }
-  if(mkdir("123456789012345/12345678901234") == 0){
-    printf(1, "mkdir 12345678901234/123456789012345 succeeded!\n");
+  if(mkdir("1234567890123456789012345678901/123456789012345678901234567890") == 0){
+    printf(1, "mkdir 123456789012345678901234567890/1234567890123456789012345678901 succeeded!\n");
     exit();
   }
 
-  printf(1, "fourteen ok\n");
+  printf(1, "thirty ok\n");
 }
 
 void
@@ -1347,7 +1347,7 @@ iref(void)
 
   printf(1, "empty file name\n");
 
-  // the 50 is NINODE
+  // more than the old, fixed NINODE of 50
   for(i = 0; i < 50 + 1; i++){
     if(mkdir("irefd") != 0){
       printf(1, "mkdir irefd failed\n");
@@ -1785,7 +1785,7 @@ main(int argc, char *argv[])
   exitwait();
 
   rmdot();
-  fourteen();
+  thirty();
   bigfile();
   subdir();
   linktest();
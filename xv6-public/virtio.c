@@ -0,0 +1,240 @@
+// Virtio-blk driver, for a legacy virtio PCI device that
+// QEMU attaches with -device virtio-blk-pci. It serves disk 1
+// through iderw's interface when there is no IDE disk 1.
+//
+// Unlike the IDE controller, the device accepts many requests
+// at once: each caller puts its chain of descriptors on the
+// avail ring and sleeps, and virtiointr wakes it when the
+// device returns the chain on the used ring.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+#include "virtio.h"
+
+#define VIOQMAX  256  // largest queue vq has room for
+#define VIOSEG   64   // bufs per request
+
+int virtioirq;  // 0 if there is no device
+
+static struct {
+  struct spinlock lock;
+  uint base;
+  uint qsize;
+  uint nblock;  // capacity in blocks
+
+  struct vdesc *desc;
+  struct vavail *avail;
+  struct vused *used;
+  ushort usedidx;  // next used entry to look at
+
+  uchar free[VIOQMAX];
+  int nfree;
+
+  // Per request, indexed by its first descriptor.
+  struct {
+    struct vblkreq hdr;
+    uchar status;
+    int done;
+    struct buf **bv;
+    int n;
+  } req[VIOQMAX];
+} vio;
+
+// Page-aligned memory for the queue, by the legacy layout.
+static char vq[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+virtioinit(void)
+{
+  struct pcidev pci;
+  uint n, i;
+
+  // Transitional virtio-blk; the modern id is 0x1042.
+  if(pcifind(0x1af4, 0x1001, &pci) < 0 || !(pci.bar[0] & PCI_BAR_IO))
+    return;
+  initlock(&vio.lock, "virtio");
+  vio.base = pci.bar[0] & PCI_BAR_IOMASK;
+  pcimaster(&pci);
+
+  outb(vio.base+VIO_STATUS, 0);
+  outb(vio.base+VIO_STATUS, VIO_ACK);
+  outb(vio.base+VIO_STATUS, VIO_ACK|VIO_DRIVER);
+  outl(vio.base+VIO_GFEATURES, 0);
+
+  outw(vio.base+VIO_QSEL, 0);
+  n = inw(vio.base+VIO_QSIZE);
+  if(n == 0 || n > VIOQMAX || n < VIOSEG+2)
+    panic("virtioinit: queue size");
+  vio.qsize = n;
+  vio.desc = (struct vdesc*)vq;
+  vio.avail = (struct vavail*)(vq + n*sizeof(struct vdesc));
+  vio.used = (struct vused*)(vq + PGROUNDUP(n*sizeof(struct vdesc) + (3+n)*sizeof(ushort)));
+  for(i = 0; i < n; i++)
+    vio.free[i] = 1;
+  vio.nfree = n;
+  outl(vio.base+VIO_QPFN, V2P(vq) / PGSIZE);
+
+  // The capacity is 64 bits of sectors; past 2^32 blocks
+  // only the first 2^32 can be named.
+  vio.nblock = inl(vio.base+VIO_CONFIG) / (BSIZE/512);
+  if(inl(vio.base+VIO_CONFIG+4) != 0)
+    vio.nblock = 0xffffffff;
+
+  virtioirq = pci.irq;
+  ioapicenable(virtioirq, ncpu - 1);
+  outb(vio.base+VIO_STATUS, VIO_ACK|VIO_DRIVER|VIO_DRIVER_OK);
+}
+
+static int
+alloc1(void)
+{
+  int i;
+
+  for(i = 0; i < vio.qsize; i++){
+    if(vio.free[i]){
+      vio.free[i] = 0;
+      vio.nfree--;
+      return i;
+    }
+  }
+  panic("virtio: alloc1");
+}
+
+// Return chain i to the free descriptors.
+static void
+freechain(int i)
+{
+  for(;;){
+    vio.free[i] = 1;
+    vio.nfree++;
+    if(!(vio.desc[i].flags & VDESC_NEXT))
+      break;
+    i = vio.desc[i].next;
+  }
+  wakeup(&vio.free);
+}
+
+// Put a request for bufs bv[0..n-1] on the avail ring.
+// Returns its first descriptor. Caller holds vio.lock.
+static int
+submit(struct buf **bv, int n)
+{
+  int head, d, prev, i, write;
+  unsigned long long sector;
+
+  while(vio.nfree < n+2)
+    sleep(&vio.free, &vio.lock);
+
+  write = bv[0]->flags & B_DIRTY;
+  if(bv[0]->blockno >= vio.nblock || n > vio.nblock - bv[0]->blockno)
+    panic("virtio: blockno");
+  sector = (unsigned long long)bv[0]->blockno * (BSIZE/512);
+
+  head = alloc1();
+  vio.req[head].hdr.type = write ? VBLK_OUT : VBLK_IN;
+  vio.req[head].hdr.reserved = 0;
+  vio.req[head].hdr.sector = sector;
+  vio.req[head].hdr.sectorhi = sector >> 32;
+  vio.req[head].status = 0xff;
+  vio.req[head].done = 0;
+  vio.req[head].bv = bv;
+  vio.req[head].n = n;
+  vio.desc[head].addr = V2P(&vio.req[head].hdr);
+  vio.desc[head].addrhi = 0;
+  vio.desc[head].len = sizeof(struct vblkreq);
+  vio.desc[head].flags = 0;
+
+  prev = head;
+  for(i = 0; i <= n; i++){
+    d = alloc1();
+    vio.desc[prev].flags |= VDESC_NEXT;
+    vio.desc[prev].next = d;
+    vio.desc[d].addrhi = 0;
+    if(i < n){
+      vio.desc[d].addr = V2P(bv[i]->data);
+      vio.desc[d].len = BSIZE;
+      vio.desc[d].flags = write ? 0 : VDESC_WRITE;
+    } else {
+      vio.desc[d].addr = V2P(&vio.req[head].status);
+      vio.desc[d].len = 1;
+      vio.desc[d].flags = VDESC_WRITE;
+    }
+    prev = d;
+  }
+
+  vio.avail->ring[vio.avail->idx % vio.qsize] = head;
+  __sync_synchronize();  // ring entry before idx
+  vio.avail->idx++;
+  __sync_synchronize();
+  outw(vio.base+VIO_QNOTIFY, 0);
+  return head;
+}
+
+// Read or write bufs bv[0..n-1], which hold consecutive blocks
+// of disk 1, like iderwv. Returns -1 if there is no device.
+int
+virtiorwv(struct buf **bv, int n)
+{
+  int head[8];
+  int i, k, nreq;
+
+  if(virtioirq == 0)
+    return -1;
+
+  acquire(&vio.lock);
+  while(n > 0){
+    // Put up to NELEM(head) requests in flight, then wait.
+    for(nreq = 0; n > 0 && nreq < NELEM(head); nreq++){
+      k = n < VIOSEG ? n : VIOSEG;
+      // Only this loop frees our requests' descriptors, so
+      // don't wait in submit() for more while any are out.
+      if(nreq > 0 && vio.nfree < k+2)
+        break;
+      head[nreq] = submit(bv, k);
+      bv += k;
+      n -= k;
+    }
+    for(i = 0; i < nreq; i++){
+      while(!vio.req[head[i]].done)
+        sleep(&vio.req[head[i]], &vio.lock);
+      freechain(head[i]);
+    }
+  }
+  release(&vio.lock);
+  return 0;
+}
+
+void
+virtiointr(void)
+{
+  int id, i;
+
+  acquire(&vio.lock);
+  inb(vio.base+VIO_ISR);  // acknowledge before looking
+  while(vio.usedidx != vio.used->idx){
+    __sync_synchronize();
+    id = vio.used->ring[vio.usedidx % vio.qsize].id;
+    if(vio.req[id].status != 0)
+      panic("virtio: disk error");
+    for(i = 0; i < vio.req[id].n; i++){
+      vio.req[id].bv[i]->flags |= B_VALID;
+      vio.req[id].bv[i]->flags &= ~B_DIRTY;
+    }
+    // The waiter frees the chain: freed here, it could be
+    // reused, clearing done, before the waiter looks.
+    vio.req[id].done = 1;
+    wakeup(&vio.req[id]);
+    vio.usedidx++;
+  }
+  release(&vio.lock);
+}
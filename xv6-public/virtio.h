@@ -0,0 +1,58 @@
+// Legacy virtio over PCI, and the virtio-blk device.
+
+// Registers, at offsets from BAR0 in I/O space.
+#define VIO_FEATURES   0x00  // device features
+#define VIO_GFEATURES  0x04  // features the driver accepts
+#define VIO_QPFN       0x08  // queue address >> 12
+#define VIO_QSIZE      0x0c  // 16 bits
+#define VIO_QSEL       0x0e  // 16 bits
+#define VIO_QNOTIFY    0x10  // 16 bits
+#define VIO_STATUS     0x12  // 8 bits
+#define VIO_ISR        0x13  // 8 bits; reading acknowledges
+#define VIO_CONFIG     0x14  // device config, e.g. blk capacity
+
+// Status bits.
+#define VIO_ACK        1
+#define VIO_DRIVER     2
+#define VIO_DRIVER_OK  4
+
+// A split virtqueue: descriptors, then the ring of
+// descriptors offered to the device (avail), then on
+// the next page the ring the device hands back (used).
+struct vdesc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VDESC_NEXT   1  // chained with next
+#define VDESC_WRITE  2  // device writes (vs reads)
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;   // head of the completed chain
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct vusedelem ring[];
+};
+
+// First descriptor of a virtio-blk request; the data
+// and a one-byte status follow.
+struct vblkreq {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+};
+#define VBLK_IN   0  // read
+#define VBLK_OUT  1  // write